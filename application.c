@@ -3,40 +3,139 @@
 
 struct _PlatonApplication {
 	GtkApplication parent_instance;
+	gchar* record_path;
+	gchar* replay_path;
+	gboolean replay_max_speed;
+	GMemoryMonitor* memory_monitor;
 };
 
 G_DEFINE_TYPE(PlatonApplication, platon_application, GTK_TYPE_APPLICATION)
 
+static void replay_finished(GObject* source_object, GAsyncResult* result, gpointer user_data) {
+	PlatonApplication* self = PLATON_APPLICATION(user_data);
+	GError* error = NULL;
+	gchar* report = platon_editor_widget_replay_trace_finish(PLATON_EDITOR_WIDGET(source_object), result, &error);
+	if (report) {
+		g_print("%s", report);
+		g_free(report);
+	}
+	else {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	}
+	g_application_quit(G_APPLICATION(self));
+}
+
+// traces start from the saved document, so the first window of a traced session opens it without the journal
+static gboolean is_tracing(PlatonApplication* self) {
+	return self->record_path || self->replay_path;
+}
+
+// the trace options apply to the first window that is opened
+static void start_trace(PlatonApplication* self, PlatonWindow* window) {
+	PlatonEditorWidget* editor_widget = platon_window_get_editor_widget(window);
+	if (self->record_path) {
+		if (!platon_editor_widget_record_trace(editor_widget, self->record_path)) {
+			g_printerr("failed to record trace %s\n", self->record_path);
+		}
+		g_clear_pointer(&self->record_path, g_free);
+	}
+	if (self->replay_path) {
+		platon_editor_widget_replay_trace(editor_widget, self->replay_path, self->replay_max_speed, replay_finished, self);
+		g_clear_pointer(&self->replay_path, g_free);
+	}
+}
+
+static void handle_low_memory_warning(GMemoryMonitor* memory_monitor, GMemoryMonitorWarningLevel level, gpointer user_data) {
+	PlatonApplication* self = PLATON_APPLICATION(user_data);
+	for (GList* windows = gtk_application_get_windows(GTK_APPLICATION(self)); windows; windows = windows->next) {
+		if (PLATON_IS_WINDOW(windows->data)) {
+			platon_editor_widget_trim_memory(platon_window_get_editor_widget(PLATON_WINDOW(windows->data)), level);
+		}
+	}
+}
+
+static void memory_report(GSimpleAction* action, GVariant* parameter, gpointer user_data) {
+	PlatonApplication* self = PLATON_APPLICATION(user_data);
+	GString* report = g_string_new(NULL);
+	for (GList* windows = gtk_application_get_windows(GTK_APPLICATION(self)); windows; windows = windows->next) {
+		if (PLATON_IS_WINDOW(windows->data)) {
+			gchar* editor_report = platon_editor_widget_get_memory_report(platon_window_get_editor_widget(PLATON_WINDOW(windows->data)));
+			g_string_append(report, editor_report);
+			g_free(editor_report);
+		}
+	}
+	g_message("%s", report->str);
+	g_string_free(report, TRUE);
+}
+
+static gint platon_application_handle_local_options(GApplication* application, GVariantDict* options) {
+	PlatonApplication* self = PLATON_APPLICATION(application);
+	g_variant_dict_lookup(options, "record", "^ay", &self->record_path);
+	g_variant_dict_lookup(options, "replay", "^ay", &self->replay_path);
+	self->replay_max_speed = g_variant_dict_contains(options, "replay-max-speed");
+	if (self->record_path || self->replay_path) {
+		// traces are recorded and replayed in this process rather than in an already running instance
+		g_application_set_flags(application, g_application_get_flags(application) | G_APPLICATION_NON_UNIQUE);
+	}
+	return -1;
+}
+
 static void platon_application_startup(GApplication* application) {
 	PlatonApplication* self = PLATON_APPLICATION(application);
 	G_APPLICATION_CLASS(platon_application_parent_class)->startup(application);
 	gtk_application_set_accels_for_action(GTK_APPLICATION(application), "win.save", (const gchar*[]){"<Primary>S", NULL});
+	gtk_application_set_accels_for_action(GTK_APPLICATION(application), "win.wrap", (const gchar*[]){"<Alt>Z", NULL});
+	gtk_application_set_accels_for_action(GTK_APPLICATION(application), "win.latency-report", (const gchar*[]){"<Primary><Shift>L", NULL});
+	gtk_application_set_accels_for_action(GTK_APPLICATION(application), "app.memory-report", (const gchar*[]){"<Primary><Shift>M", NULL});
+
+	GSimpleAction* memory_report_action = g_simple_action_new("memory-report", NULL);
+	g_signal_connect_object(memory_report_action, "activate", G_CALLBACK(memory_report), self, 0);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(memory_report_action));
+	g_object_unref(memory_report_action);
+
+	self->memory_monitor = g_memory_monitor_dup_default();
+	g_signal_connect_object(self->memory_monitor, "low-memory-warning", G_CALLBACK(handle_low_memory_warning), self, 0);
 }
 
 static void platon_application_activate(GApplication* application) {
 	PlatonApplication* self = PLATON_APPLICATION(application);
 	PlatonWindow* window = platon_window_new(GTK_APPLICATION(self));
-	platon_window_open_file(window, NULL);
+	platon_window_open_file(window, NULL, !is_tracing(self));
 	gtk_window_present(GTK_WINDOW(window));
+	start_trace(self, window);
 }
 
 static void platon_application_open(GApplication* application, GFile** files, gint n_files, const gchar* hint) {
 	PlatonApplication* self = PLATON_APPLICATION(application);
 	for (gint i = 0; i < n_files; ++i) {
 		PlatonWindow* window = platon_window_new(GTK_APPLICATION(self));
-		platon_window_open_file(window, files[i]);
+		platon_window_open_file(window, files[i], !is_tracing(self));
 		gtk_window_present(GTK_WINDOW(window));
+		start_trace(self, window);
 	}
 }
 
+static void platon_application_finalize(GObject* object) {
+	PlatonApplication* self = PLATON_APPLICATION(object);
+	g_free(self->record_path);
+	g_free(self->replay_path);
+	g_clear_object(&self->memory_monitor);
+	G_OBJECT_CLASS(platon_application_parent_class)->finalize(object);
+}
+
 static void platon_application_class_init(PlatonApplicationClass* klass) {
+	G_OBJECT_CLASS(klass)->finalize = platon_application_finalize;
+	G_APPLICATION_CLASS(klass)->handle_local_options = platon_application_handle_local_options;
 	G_APPLICATION_CLASS(klass)->startup = platon_application_startup;
 	G_APPLICATION_CLASS(klass)->activate = platon_application_activate;
 	G_APPLICATION_CLASS(klass)->open = platon_application_open;
 }
 
 static void platon_application_init(PlatonApplication* self) {
-
+	g_application_add_main_option(G_APPLICATION(self), "record", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, "Record the input of the first window to a trace file", "FILE");
+	g_application_add_main_option(G_APPLICATION(self), "replay", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, "Replay a trace file in the first window, print latency histograms and quit", "FILE");
+	g_application_add_main_option(G_APPLICATION(self), "replay-max-speed", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, "Replay the trace as fast as possible instead of at its original speed", NULL);
 }
 
 PlatonApplication* platon_application_new(void) {
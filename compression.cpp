@@ -0,0 +1,270 @@
+#include "compression.hpp"
+#include "encoding.hpp"
+#include <cstring>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define GZIP_MAGIC "\x1F\x8B"
+#define ZSTD_MAGIC "\x28\xB5\x2F\xFD"
+
+#ifdef HAVE_ZSTD
+
+// a GConverter for zstd streams; GIO only ships one for zlib
+#define PLATON_TYPE_ZSTD_CONVERTER platon_zstd_converter_get_type()
+G_DECLARE_FINAL_TYPE(PlatonZstdConverter, platon_zstd_converter, PLATON, ZSTD_CONVERTER, GObject)
+
+struct _PlatonZstdConverter {
+	GObject parent_instance;
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+};
+
+static void platon_zstd_converter_iface_init(GConverterIface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(PlatonZstdConverter, platon_zstd_converter, G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE(G_TYPE_CONVERTER, platon_zstd_converter_iface_init)
+)
+
+static GConverterResult platon_zstd_converter_convert(GConverter* converter, const void* inbuf, gsize inbuf_size, void* outbuf, gsize outbuf_size, GConverterFlags flags, gsize* bytes_read, gsize* bytes_written, GError** error) {
+	PlatonZstdConverter* self = PLATON_ZSTD_CONVERTER(converter);
+	ZSTD_inBuffer input = {inbuf, inbuf_size, 0};
+	ZSTD_outBuffer output = {outbuf, outbuf_size, 0};
+	const bool input_at_end = flags & G_CONVERTER_INPUT_AT_END;
+	std::size_t result;
+	if (self->cctx) {
+		const ZSTD_EndDirective directive = input_at_end ? ZSTD_e_end : (flags & G_CONVERTER_FLUSH) ? ZSTD_e_flush : ZSTD_e_continue;
+		result = ZSTD_compressStream2(self->cctx, &output, &input, directive);
+	}
+	else {
+		result = ZSTD_decompressStream(self->dctx, &output, &input);
+	}
+	if (ZSTD_isError(result)) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s", ZSTD_getErrorName(result));
+		return G_CONVERTER_ERROR;
+	}
+	*bytes_read = input.pos;
+	*bytes_written = output.pos;
+	// the result is the number of bytes left to flush when compressing and 0 at the end of a frame when decompressing
+	if (result == 0 && input.pos == input.size) {
+		if (input_at_end) {
+			return G_CONVERTER_FINISHED;
+		}
+		if (flags & G_CONVERTER_FLUSH) {
+			return G_CONVERTER_FLUSHED;
+		}
+	}
+	if (input.pos == 0 && output.pos == 0) {
+		if (input_at_end) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "truncated zstd stream");
+		}
+		else {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "need more input");
+		}
+		return G_CONVERTER_ERROR;
+	}
+	return G_CONVERTER_CONVERTED;
+}
+
+static void platon_zstd_converter_reset(GConverter* converter) {
+	PlatonZstdConverter* self = PLATON_ZSTD_CONVERTER(converter);
+	if (self->cctx) ZSTD_CCtx_reset(self->cctx, ZSTD_reset_session_only);
+	if (self->dctx) ZSTD_DCtx_reset(self->dctx, ZSTD_reset_session_only);
+}
+
+static void platon_zstd_converter_finalize(GObject* object) {
+	PlatonZstdConverter* self = PLATON_ZSTD_CONVERTER(object);
+	ZSTD_freeCCtx(self->cctx);
+	ZSTD_freeDCtx(self->dctx);
+	G_OBJECT_CLASS(platon_zstd_converter_parent_class)->finalize(object);
+}
+
+static void platon_zstd_converter_iface_init(GConverterIface* iface) {
+	iface->convert = platon_zstd_converter_convert;
+	iface->reset = platon_zstd_converter_reset;
+}
+
+static void platon_zstd_converter_class_init(PlatonZstdConverterClass* klass) {
+	G_OBJECT_CLASS(klass)->finalize = platon_zstd_converter_finalize;
+}
+
+static void platon_zstd_converter_init(PlatonZstdConverter* self) {
+	self->cctx = NULL;
+	self->dctx = NULL;
+}
+
+static GConverter* platon_zstd_converter_new(bool compress) {
+	PlatonZstdConverter* self = PLATON_ZSTD_CONVERTER(g_object_new(PLATON_TYPE_ZSTD_CONVERTER, NULL));
+	if (compress) {
+		self->cctx = ZSTD_createCCtx();
+	}
+	else {
+		self->dctx = ZSTD_createDCtx();
+	}
+	return G_CONVERTER(self);
+}
+
+#endif
+
+// a GConverter that decompresses every member of a gzip file; GZlibDecompressor finishes at the end of the first member, which would silently cut off files that were written by appending members
+#define PLATON_TYPE_GZIP_DECOMPRESSOR platon_gzip_decompressor_get_type()
+G_DECLARE_FINAL_TYPE(PlatonGzipDecompressor, platon_gzip_decompressor, PLATON, GZIP_DECOMPRESSOR, GObject)
+
+struct _PlatonGzipDecompressor {
+	GObject parent_instance;
+	GConverter* member;
+	// set when a member has ended and the next one, if any, has not been started
+	bool between_members;
+};
+
+static void platon_gzip_decompressor_iface_init(GConverterIface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(PlatonGzipDecompressor, platon_gzip_decompressor, G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE(G_TYPE_CONVERTER, platon_gzip_decompressor_iface_init)
+)
+
+static GConverterResult platon_gzip_decompressor_convert(GConverter* converter, const void* inbuf, gsize inbuf_size, void* outbuf, gsize outbuf_size, GConverterFlags flags, gsize* bytes_read, gsize* bytes_written, GError** error) {
+	PlatonGzipDecompressor* self = PLATON_GZIP_DECOMPRESSOR(converter);
+	if (self->between_members) {
+		if (inbuf_size == 0) {
+			*bytes_read = 0;
+			*bytes_written = 0;
+			if (flags & G_CONVERTER_INPUT_AT_END) {
+				return G_CONVERTER_FINISHED;
+			}
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "need more input");
+			return G_CONVERTER_ERROR;
+		}
+		g_converter_reset(self->member);
+		self->between_members = false;
+	}
+	const GConverterResult result = g_converter_convert(self->member, inbuf, inbuf_size, outbuf, outbuf_size, flags, bytes_read, bytes_written, error);
+	if (result == G_CONVERTER_FINISHED && (*bytes_read < inbuf_size || !(flags & G_CONVERTER_INPUT_AT_END))) {
+		// another member may follow
+		self->between_members = true;
+		return G_CONVERTER_CONVERTED;
+	}
+	return result;
+}
+
+static void platon_gzip_decompressor_reset(GConverter* converter) {
+	PlatonGzipDecompressor* self = PLATON_GZIP_DECOMPRESSOR(converter);
+	g_converter_reset(self->member);
+	self->between_members = false;
+}
+
+static void platon_gzip_decompressor_finalize(GObject* object) {
+	PlatonGzipDecompressor* self = PLATON_GZIP_DECOMPRESSOR(object);
+	g_object_unref(self->member);
+	G_OBJECT_CLASS(platon_gzip_decompressor_parent_class)->finalize(object);
+}
+
+static void platon_gzip_decompressor_iface_init(GConverterIface* iface) {
+	iface->convert = platon_gzip_decompressor_convert;
+	iface->reset = platon_gzip_decompressor_reset;
+}
+
+static void platon_gzip_decompressor_class_init(PlatonGzipDecompressorClass* klass) {
+	G_OBJECT_CLASS(klass)->finalize = platon_gzip_decompressor_finalize;
+}
+
+static void platon_gzip_decompressor_init(PlatonGzipDecompressor* self) {
+	self->member = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+	self->between_members = false;
+}
+
+Compression detect_compression(const char* path) {
+	GFile* file = g_file_new_for_path(path);
+	GFileInputStream* input = g_file_read(file, NULL, NULL);
+	g_object_unref(file);
+	if (!input) {
+		return Compression::NONE;
+	}
+	char magic[4];
+	gsize length = 0;
+	g_input_stream_read_all(G_INPUT_STREAM(input), magic, sizeof(magic), &length, NULL, NULL);
+	g_object_unref(input);
+	if (length >= 2 && std::memcmp(magic, GZIP_MAGIC, 2) == 0) {
+		return Compression::GZIP;
+	}
+	if (length >= 4 && std::memcmp(magic, ZSTD_MAGIC, 4) == 0) {
+#ifdef HAVE_ZSTD
+		return Compression::ZSTD;
+#else
+		g_warning("%s is compressed with zstd, which this build does not support", path);
+#endif
+	}
+	return Compression::NONE;
+}
+
+Compression get_compression_for_path(const char* path) {
+	if (g_str_has_suffix(path, ".gz")) {
+		return Compression::GZIP;
+	}
+#ifdef HAVE_ZSTD
+	if (g_str_has_suffix(path, ".zst")) {
+		return Compression::ZSTD;
+	}
+#endif
+	return Compression::NONE;
+}
+
+GConverter* create_decompressor(Compression compression) {
+	switch (compression) {
+	case Compression::GZIP:
+		return G_CONVERTER(g_object_new(PLATON_TYPE_GZIP_DECOMPRESSOR, NULL));
+#ifdef HAVE_ZSTD
+	case Compression::ZSTD:
+		// zstd decompresses concatenated frames by itself
+		return platon_zstd_converter_new(false);
+#endif
+	default:
+		return NULL;
+	}
+}
+
+GConverter* create_compressor(Compression compression) {
+	switch (compression) {
+	case Compression::GZIP:
+		return G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+#ifdef HAVE_ZSTD
+	case Compression::ZSTD:
+		return platon_zstd_converter_new(true);
+#endif
+	default:
+		return NULL;
+	}
+}
+
+bool compress_file(const char* source_path, const char* path, Compression compression) {
+	GError* error = NULL;
+	GFile* source = g_file_new_for_path(source_path);
+	GFileInputStream* input = g_file_read(source, NULL, &error);
+	g_object_unref(source);
+	GFileOutputStream* output = NULL;
+	if (input) {
+		GFile* file = g_file_new_for_path(path);
+		output = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
+		g_object_unref(file);
+	}
+	bool result = input && output;
+	if (result) {
+		GConverter* compressor = create_compressor(compression);
+		GOutputStream* compressed = g_converter_output_stream_new(G_OUTPUT_STREAM(output), compressor);
+		g_object_unref(compressor);
+		// closing the converter stream writes the end of the compressed stream, but must not close the file before it is known to be complete
+		g_filter_output_stream_set_close_base_stream(G_FILTER_OUTPUT_STREAM(compressed), FALSE);
+		result = g_output_stream_splice(compressed, G_INPUT_STREAM(input), G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, &error) >= 0;
+		g_object_unref(compressed);
+	}
+	if (output) {
+		result = close_output(G_OUTPUT_STREAM(output), result, &error);
+	}
+	if (!result) {
+		g_warning("failed to compress %s: %s", path, error->message);
+		g_error_free(error);
+	}
+	if (output) g_object_unref(output);
+	if (input) g_object_unref(input);
+	return result;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <gio/gio.h>
+
+enum class Compression {
+	NONE,
+	GZIP,
+	ZSTD
+};
+
+// detects compressed files by their magic bytes; formats this build cannot decompress are reported as NONE
+Compression detect_compression(const char* path);
+
+// chooses the compression of a file that is saved under a new name by its extension
+Compression get_compression_for_path(const char* path);
+
+GConverter* create_decompressor(Compression compression);
+GConverter* create_compressor(Compression compression);
+
+// writes the file at source_path to path, compressed
+bool compress_file(const char* source_path, const char* path, Compression compression);
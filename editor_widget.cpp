@@ -1,7 +1,16 @@
 #include "editor_widget.h"
 #include "core/editor.hpp"
+#include "compression.hpp"
+#include "encoding.hpp"
+#include "journal.hpp"
+#include "trace.hpp"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstring>
 #include <map>
+#include <memory>
 
 #if !GLIB_CHECK_VERSION(2, 73, 2)
 #define G_CONNECT_DEFAULT ((GConnectFlags)0)
@@ -10,41 +19,82 @@
 #define LINE_HEIGHT 1.5
 #define HORIZONTAL_PADDING 2.0
 #define VERTICAL_PADDING 1.0
+#define TAB_WIDTH 4
+#define SCAN_CHUNK 1024
+#define PARALLEL_SHAPING_THRESHOLD 16
+#define LOAD_FIRST_CHUNK_SIZE (64 * 1024)
+#define LOAD_CHUNK_SIZE (1024 * 1024)
+// the size of a std::map node in addition to its value: the color and three pointers
+#define MAP_NODE_OVERHEAD (4 * sizeof(void*))
 
 static void set_source(cairo_t* cr, const Color& color) {
 	cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
 }
 
+// the attributes of a span that affect shaping; colors are applied when drawing
+struct FontSpan {
+	std::size_t start;
+	std::size_t end;
+	bool bold;
+	bool italic;
+	bool operator <(const FontSpan& span) const {
+		return std::tie(start, end, bold, italic) < std::tie(span.start, span.end, span.bold, span.italic);
+	}
+};
+
+static std::vector<FontSpan> get_font_spans(const Theme& theme, const std::vector<Span>& spans) {
+	std::vector<FontSpan> font_spans;
+	for (const Span& span: spans) {
+		const Style& style = theme.styles[span.style];
+		if (style.bold || style.italic) {
+			font_spans.push_back({span.start, span.end, style.bold, style.italic});
+		}
+	}
+	return font_spans;
+}
+
+// returns the style of the span containing the given index
+static int get_style(const std::vector<Span>& spans, std::size_t index, int default_style) {
+	auto iter = std::upper_bound(spans.begin(), spans.end(), index, [](std::size_t index, const Span& span) {
+		return index < span.start;
+	});
+	if (iter != spans.begin() && index < std::prev(iter)->end) {
+		return std::prev(iter)->style;
+	}
+	return default_style;
+}
+
 class Layout {
-	int style;
 	PangoLayout* layout;
 public:
-	Layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const std::string& text, int style, const std::vector<Span>& spans): style(style) {
+	Layout(PangoContext* context, PangoFontDescription* font_description, const std::string& text, const std::vector<FontSpan>& font_spans, double width) {
 		layout = pango_layout_new(context);
 		pango_layout_set_font_description(layout, font_description);
-		pango_layout_set_text(layout, text.c_str(), -1);
-		if (spans.empty()) {
+		if (width > 0.0) {
+			pango_layout_set_width(layout, pango_units_from_double(width));
+			pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+		}
+		if (validate_utf8(text.data(), text.size()) == text.size() && !std::memchr(text.data(), '\0', text.size())) {
+			pango_layout_set_text(layout, text.data(), text.size());
+		}
+		else {
+			std::string sanitized(text);
+			sanitize_utf8(sanitized);
+			pango_layout_set_text(layout, sanitized.data(), sanitized.size());
+		}
+		if (font_spans.empty()) {
 			return;
 		}
 		PangoAttrList* attrs = pango_attr_list_new();
-		for (const Span& span: spans) {
-			const Style& style = theme.styles[span.style];
-			PangoAttribute* attr = pango_attr_foreground_new(style.color.r * G_MAXUINT16, style.color.g * G_MAXUINT16, style.color.b * G_MAXUINT16);
-			attr->start_index = span.start;
-			attr->end_index = span.end;
-			pango_attr_list_insert(attrs, attr);
-			attr = pango_attr_foreground_alpha_new(style.color.a * G_MAXUINT16);
-			attr->start_index = span.start;
-			attr->end_index = span.end;
-			pango_attr_list_insert(attrs, attr);
-			if (style.bold) {
-				attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
+		for (const FontSpan& span: font_spans) {
+			if (span.bold) {
+				PangoAttribute* attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
 				attr->start_index = span.start;
 				attr->end_index = span.end;
 				pango_attr_list_insert(attrs, attr);
 			}
-			if (style.italic) {
-				attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
+			if (span.italic) {
+				PangoAttribute* attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
 				attr->start_index = span.start;
 				attr->end_index = span.end;
 				pango_attr_list_insert(attrs, attr);
@@ -53,36 +103,111 @@ public:
 		pango_layout_set_attributes(layout, attrs);
 		pango_attr_list_unref(attrs);
 	}
-	Layout(const Layout& layout): style(layout.style), layout(layout.layout) {
+	Layout(const Layout& layout): layout(layout.layout) {
 		g_object_ref(this->layout);
 	}
 	~Layout() {
 		g_object_unref(layout);
 	}
 	Layout& operator =(const Layout& layout) {
-		this->style = layout.style;
 		g_set_object(&this->layout, layout.layout);
 		return *this;
 	}
-	void draw(cairo_t* cr, const Theme& theme, double x, double y, bool align_right = false) const {
-		PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, 0);
-		if (align_right) {
-			PangoRectangle extents;
-			pango_layout_line_get_pixel_extents(layout_line, NULL, &extents);
-			x -= extents.width;
-		}
-		cairo_move_to(cr, x, y);
-		set_source(cr, theme.styles[style].color);
-		pango_cairo_show_layout_line(cr, layout_line);
-	}
-	double index_to_x(std::size_t index) const {
-		PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, 0);
-		int x_pos;
-		pango_layout_line_index_to_x(layout_line, index, false, &x_pos);
+	std::size_t get_rows() const {
+		return pango_layout_get_line_count(layout);
+	}
+	// the width covered by the text, including glyphs that extend beyond their logical extents
+	double get_width() const {
+		PangoRectangle ink_rect, logical_rect;
+		pango_layout_get_pixel_extents(layout, &ink_rect, &logical_rect);
+		return std::max(ink_rect.x + ink_rect.width, logical_rect.x + logical_rect.width);
+	}
+	// draws the shaped glyphs, coloring consecutive glyphs that share a style together
+	void draw(cairo_t* cr, const Theme& theme, int style, const std::vector<Span>& spans, double x, double y, double line_height, bool align_right = false) const {
+		const int rows = pango_layout_get_line_count(layout);
+		for (int row = 0; row < rows; ++row) {
+			PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, row);
+			double line_x = x;
+			if (align_right) {
+				PangoRectangle extents;
+				pango_layout_line_get_pixel_extents(layout_line, NULL, &extents);
+				line_x -= extents.width;
+			}
+			const double line_y = y + row * line_height;
+			if (spans.empty()) {
+				set_source(cr, theme.styles[style].color);
+				cairo_move_to(cr, line_x, line_y);
+				pango_cairo_show_layout_line(cr, layout_line);
+				continue;
+			}
+			for (GSList* runs = layout_line->runs; runs; runs = runs->next) {
+				PangoGlyphItem* run = (PangoGlyphItem*)runs->data;
+				PangoGlyphString* glyphs = run->glyphs;
+				int start = 0;
+				while (start < glyphs->num_glyphs) {
+					const int glyph_style = get_style(spans, run->item->offset + glyphs->log_clusters[start], style);
+					int end = start;
+					int width = 0;
+					while (end < glyphs->num_glyphs && get_style(spans, run->item->offset + glyphs->log_clusters[end], style) == glyph_style) {
+						width += glyphs->glyphs[end].geometry.width;
+						++end;
+					}
+					PangoGlyphString part = *glyphs;
+					part.num_glyphs = end - start;
+					part.glyphs = glyphs->glyphs + start;
+					part.log_clusters = glyphs->log_clusters + start;
+					set_source(cr, theme.styles[glyph_style].color);
+					cairo_move_to(cr, line_x, line_y);
+					pango_cairo_show_glyph_string(cr, run->item->analysis.font, &part);
+					line_x += pango_units_to_double(width);
+					start = end;
+				}
+			}
+		}
+	}
+	double index_to_x(std::size_t index, std::size_t* row = nullptr) const {
+		int line, x_pos;
+		pango_layout_index_to_line_x(layout, index, false, &line, &x_pos);
+		if (row) {
+			*row = std::max(line, 0);
+		}
 		return pango_units_to_double(x_pos);
 	}
-	std::size_t x_to_index(double x) const {
-		PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, 0);
+	// calls f(row, start_x, end_x) for every horizontal range covered by the given byte range
+	template <class F> void for_each_range(std::size_t start, std::size_t end, F f) const {
+		const int rows = pango_layout_get_line_count(layout);
+		for (int row = 0; row < rows; ++row) {
+			PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, row);
+			const std::size_t line_start = layout_line->start_index;
+			const std::size_t line_end = line_start + layout_line->length;
+			if (start > line_end || end <= line_start || (start == line_end && row + 1 < rows)) {
+				continue;
+			}
+			int* ranges;
+			int n_ranges;
+			pango_layout_line_get_x_ranges(layout_line, std::max(start, line_start), end, &ranges, &n_ranges);
+			for (int i = 0; i < n_ranges; ++i) {
+				f(row, pango_units_to_double(ranges[i * 2]), pango_units_to_double(ranges[i * 2 + 1]));
+			}
+			g_free(ranges);
+		}
+	}
+	// an estimate of the memory held by the shaped lines and glyphs
+	std::size_t get_memory_usage() const {
+		std::size_t bytes = std::strlen(pango_layout_get_text(layout)) + 1;
+		for (GSList* lines = pango_layout_get_lines_readonly(layout); lines; lines = lines->next) {
+			PangoLayoutLine* layout_line = (PangoLayoutLine*)lines->data;
+			bytes += sizeof(PangoLayoutLine);
+			for (GSList* runs = layout_line->runs; runs; runs = runs->next) {
+				PangoGlyphItem* run = (PangoGlyphItem*)runs->data;
+				bytes += sizeof(PangoGlyphItem) + sizeof(PangoItem) + sizeof(PangoGlyphString) + run->glyphs->space * (sizeof(PangoGlyphInfo) + sizeof(gint));
+			}
+		}
+		return bytes;
+	}
+	std::size_t x_to_index(double x, std::size_t row = 0) const {
+		const int rows = pango_layout_get_line_count(layout);
+		PangoLayoutLine* layout_line = pango_layout_get_line_readonly(layout, std::min<std::size_t>(row, rows - 1));
 		int index, trailing;
 		pango_layout_line_x_to_index(layout_line, pango_units_from_double(x), &index, &trailing);
 		const char* text = pango_layout_get_text(layout);
@@ -97,35 +222,257 @@ public:
 class LayoutCache {
 	struct Key {
 		std::string text;
-		int style;
-		std::vector<Span> spans;
-		Key(const std::string& text, int style, const std::vector<Span>& spans): text(text), style(style), spans(spans) {}
+		std::vector<FontSpan> font_spans;
+		double width;
+		Key(const std::string& text, const std::vector<FontSpan>& font_spans, double width): text(text), font_spans(font_spans), width(width) {}
 		bool operator <(const Key& key) const {
-			return std::tie(text, style, spans) < std::tie(key.text, key.style, key.spans);
+			return std::tie(text, font_spans, width) < std::tie(key.text, key.font_spans, key.width);
+		}
+	};
+	// refers to the text and font spans of a line, so that looking it up in the cache doesn't copy them
+	struct KeyView {
+		const std::string& text;
+		const std::vector<FontSpan>& font_spans;
+		double width;
+	};
+	struct KeyCompare {
+		using is_transparent = void;
+		template <class A, class B> bool operator ()(const A& a, const B& b) const {
+			return std::tie(a.text, a.font_spans, a.width) < std::tie(b.text, b.font_spans, b.width);
 		}
 	};
-	std::map<Key, std::pair<Layout, std::size_t>> cache;
+	// the cache misses of one frame, shaped by the worker threads and the main thread together
+	struct ShapingBatch {
+		const std::vector<Key>* keys;
+		std::vector<std::unique_ptr<Layout>> layouts;
+		std::atomic<std::size_t> next_key;
+		PangoFontDescription* font_description;
+		double resolution;
+		const cairo_font_options_t* font_options;
+		PangoLanguage* language;
+		std::size_t running_workers;
+		GMutex mutex;
+		GCond cond;
+	};
+	// pango contexts and font maps must not be shared between threads, so every worker thread has its own;
+	// workers only run while the main thread waits in prefetch, so their layouts can be used on the main thread afterwards
+	static GPrivate worker_context;
+	std::map<Key, std::pair<Layout, std::size_t>, KeyCompare> cache;
 	std::size_t generation;
+	static void shape(ShapingBatch* batch, PangoContext* context) {
+		for (std::size_t i = batch->next_key++; i < batch->keys->size(); i = batch->next_key++) {
+			const Key& key = (*batch->keys)[i];
+			batch->layouts[i].reset(new Layout(context, batch->font_description, key.text, key.font_spans, key.width));
+			// lines are laid out lazily; make sure that happens here and not on the main thread
+			batch->layouts[i]->get_rows();
+		}
+	}
+	static void shape_func(gpointer data, gpointer user_data) {
+		ShapingBatch* batch = (ShapingBatch*)data;
+		PangoContext* context = (PangoContext*)g_private_get(&worker_context);
+		if (!context) {
+			PangoFontMap* font_map = pango_cairo_font_map_new();
+			context = pango_font_map_create_context(font_map);
+			g_object_unref(font_map);
+			g_private_set(&worker_context, context);
+		}
+		// changing the context invalidates its caches, so only do so if the settings of the widget have changed
+		if (pango_cairo_context_get_resolution(context) != batch->resolution) {
+			pango_cairo_context_set_resolution(context, batch->resolution);
+		}
+		const cairo_font_options_t* font_options = pango_cairo_context_get_font_options(context);
+		if (font_options != batch->font_options && (!font_options || !batch->font_options || !cairo_font_options_equal(font_options, batch->font_options))) {
+			pango_cairo_context_set_font_options(context, batch->font_options);
+		}
+		if (pango_context_get_language(context) != batch->language) {
+			pango_context_set_language(context, batch->language);
+		}
+		shape(batch, context);
+		g_mutex_lock(&batch->mutex);
+		if (--batch->running_workers == 0) {
+			g_cond_signal(&batch->cond);
+		}
+		g_mutex_unlock(&batch->mutex);
+	}
+	static GThreadPool* get_worker_pool() {
+		static GThreadPool* worker_pool = g_thread_pool_new(shape_func, NULL, std::max(g_get_num_processors() - 1, 1u), TRUE, NULL);
+		return worker_pool;
+	}
 public:
 	LayoutCache(): generation(0) {}
-	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const std::string& text, int style, const std::vector<Span>& spans) {
-		Key key(text, style, spans);
-		auto iter = cache.find(key);
+	// shapes the layouts of the given lines and their line numbers in parallel if enough of them miss the cache, for example after a jump or on the first frame
+	void prefetch(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const std::vector<RenderedLine>& lines, double width) {
+		// on most frames every line hits the cache, so keys are only copied for misses
+		std::vector<Key> keys;
+		const std::vector<FontSpan> no_font_spans;
+		for (const RenderedLine& line: lines) {
+			const std::vector<FontSpan> font_spans = get_font_spans(theme, line.spans);
+			if (cache.find(KeyView{line.text, font_spans, width}) == cache.end()) {
+				keys.emplace_back(line.text, font_spans, width);
+			}
+			const std::string number = std::to_string(line.number);
+			if (cache.find(KeyView{number, no_font_spans, -1.0}) == cache.end()) {
+				keys.emplace_back(number, no_font_spans, -1.0);
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+			return !(a < b) && !(b < a);
+		}), keys.end());
+		if (keys.size() < PARALLEL_SHAPING_THRESHOLD) {
+			return;
+		}
+		ShapingBatch batch;
+		batch.keys = &keys;
+		batch.layouts.resize(keys.size());
+		batch.next_key = 0;
+		batch.font_description = font_description;
+		batch.resolution = pango_cairo_context_get_resolution(context);
+		batch.font_options = pango_cairo_context_get_font_options(context);
+		batch.language = pango_context_get_language(context);
+		g_mutex_init(&batch.mutex);
+		g_cond_init(&batch.cond);
+		GThreadPool* worker_pool = get_worker_pool();
+		batch.running_workers = std::min<std::size_t>(g_thread_pool_get_max_threads(worker_pool), keys.size() - 1);
+		for (std::size_t i = 0; i < batch.running_workers; ++i) {
+			g_thread_pool_push(worker_pool, &batch, NULL);
+		}
+		// the main thread takes part using the context of the widget
+		shape(&batch, context);
+		g_mutex_lock(&batch.mutex);
+		while (batch.running_workers > 0) {
+			g_cond_wait(&batch.cond, &batch.mutex);
+		}
+		g_mutex_unlock(&batch.mutex);
+		g_mutex_clear(&batch.mutex);
+		g_cond_clear(&batch.cond);
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			cache.insert({std::move(keys[i]), {*batch.layouts[i], generation}});
+		}
+	}
+	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const std::string& text, const std::vector<Span>& spans, double width) {
+		const std::vector<FontSpan> font_spans = get_font_spans(theme, spans);
+		auto iter = cache.find(KeyView{text, font_spans, width});
 		if (iter != cache.end()) {
 			iter->second.second = generation;
 			return iter->second.first;
 		}
 		else {
-			Layout layout(context, font_description, theme, text, style, spans);
-			cache.insert({key, {layout, generation}});
+			Layout layout(context, font_description, text, font_spans, width);
+			cache.insert({Key(text, font_spans, width), {layout, generation}});
 			return layout;
 		}
 	}
-	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const RenderedLine& line) {
-		return get_layout(context, font_description, theme, line.text, Style::DEFAULT, line.spans);
+	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, const RenderedLine& line, double width) {
+		return get_layout(context, font_description, theme, line.text, line.spans, width);
+	}
+	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, std::size_t line_number) {
+		return get_layout(context, font_description, theme, std::to_string(line_number), std::vector<Span>(), -1.0);
+	}
+	void increment_generation() {
+		++generation;
+	}
+	void collect_garbage() {
+		for (auto iter = cache.begin(); iter != cache.end();) {
+			if (iter->second.second < generation) {
+				iter = cache.erase(iter);
+			}
+			else {
+				++iter;
+			}
+		}
+	}
+	void clear() {
+		cache.clear();
+	}
+	std::size_t get_size() const {
+		return cache.size();
+	}
+	std::size_t get_memory_usage() const {
+		std::size_t bytes = 0;
+		for (const auto& entry: cache) {
+			bytes += sizeof(entry) + MAP_NODE_OVERHEAD + entry.first.text.capacity() + entry.first.font_spans.capacity() * sizeof(FontSpan) + entry.second.first.get_memory_usage();
+		}
+		return bytes;
+	}
+};
+
+GPrivate LayoutCache::worker_context = G_PRIVATE_INIT(g_object_unref);
+
+// caches the pixels of each row (background, selections, text and line number) so that unchanged rows are copied to their current position instead of being drawn again
+class RowCache {
+	struct Key {
+		std::string text;
+		std::vector<Span> spans;
+		std::vector<std::pair<std::size_t, std::size_t>> selections;
+		std::size_t number;
+		bool active;
+		double width;
+		int scale;
+		Key(const RenderedLine& line, bool active, double width, int scale): text(line.text), spans(line.spans), number(line.number), active(active), width(width), scale(scale) {
+			for (const Range& selection: line.selections) {
+				selections.emplace_back(selection.start, selection.end);
+			}
+		}
+	};
+	// refers to the contents of a rendered line, so that looking it up in the cache doesn't copy them
+	struct KeyView {
+		const std::string& text;
+		const std::vector<Span>& spans;
+		const std::vector<Range>& selections;
+		std::size_t number;
+		bool active;
+		double width;
+		int scale;
+	};
+	struct KeyCompare {
+		using is_transparent = void;
+		static std::pair<std::size_t, std::size_t> get_bounds(const Range& selection) {
+			return std::pair<std::size_t, std::size_t>(selection.start, selection.end);
+		}
+		static const std::pair<std::size_t, std::size_t>& get_bounds(const std::pair<std::size_t, std::size_t>& selection) {
+			return selection;
+		}
+		template <class A, class B> bool operator ()(const A& a, const B& b) const {
+			const auto a_fields = std::tie(a.text, a.spans, a.number, a.active, a.width, a.scale);
+			const auto b_fields = std::tie(b.text, b.spans, b.number, b.active, b.width, b.scale);
+			if (a_fields < b_fields) {
+				return true;
+			}
+			if (b_fields < a_fields) {
+				return false;
+			}
+			return std::lexicographical_compare(a.selections.begin(), a.selections.end(), b.selections.begin(), b.selections.end(), [](const auto& x, const auto& y) {
+				return get_bounds(x) < get_bounds(y);
+			});
+		}
+	};
+	std::map<Key, std::pair<cairo_surface_t*, std::size_t>, KeyCompare> cache;
+	std::size_t generation;
+public:
+	RowCache(): generation(0) {}
+	RowCache(const RowCache&) = delete;
+	~RowCache() {
+		clear();
 	}
-	Layout get_layout(PangoContext* context, PangoFontDescription* font_description, const Theme& theme, std::size_t line_number, bool active) {
-		return get_layout(context, font_description, theme, std::to_string(line_number), active ? Style::LINE_NUMBER_ACTIVE : Style::LINE_NUMBER, std::vector<Span>());
+	RowCache& operator =(const RowCache&) = delete;
+	// rows are kept as pixels in the format and scale of the window, so that drawing a cached row is a single blit;
+	// the row has the width of the widget, and its height only depends on the line, which is part of the key
+	template <class F> cairo_surface_t* get_row(GdkWindow* window, const RenderedLine& line, bool active, double width, double height, F draw_row) {
+		const int scale = gdk_window_get_scale_factor(window);
+		auto iter = cache.find(KeyView{line.text, line.spans, line.selections, line.number, active, width, scale});
+		if (iter != cache.end()) {
+			iter->second.second = generation;
+			return iter->second.first;
+		}
+		else {
+			cairo_surface_t* surface = gdk_window_create_similar_image_surface(window, CAIRO_FORMAT_ARGB32, std::ceil(width), std::ceil(height), scale);
+			cairo_t* cr = cairo_create(surface);
+			draw_row(cr);
+			cairo_destroy(cr);
+			cache.emplace(Key(line, active, width, scale), std::make_pair(surface, generation));
+			return surface;
+		}
 	}
 	void increment_generation() {
 		++generation;
@@ -133,6 +480,7 @@ public:
 	void collect_garbage() {
 		for (auto iter = cache.begin(); iter != cache.end();) {
 			if (iter->second.second < generation) {
+				cairo_surface_destroy(iter->second.first);
 				iter = cache.erase(iter);
 			}
 			else {
@@ -140,6 +488,234 @@ public:
 			}
 		}
 	}
+	void clear() {
+		for (auto& entry: cache) {
+			cairo_surface_destroy(entry.second.first);
+		}
+		cache.clear();
+	}
+	std::size_t get_size() const {
+		return cache.size();
+	}
+	std::size_t get_memory_usage() const {
+		std::size_t bytes = 0;
+		for (const auto& entry: cache) {
+			const Key& key = entry.first;
+			bytes += sizeof(entry) + MAP_NODE_OVERHEAD + key.text.capacity() + key.spans.capacity() * sizeof(Span) + key.selections.capacity() * sizeof(key.selections[0]);
+			bytes += cairo_image_surface_get_stride(entry.second.first) * cairo_image_surface_get_height(entry.second.first);
+		}
+		return bytes;
+	}
+};
+
+// maps buffer lines to visual rows; runs of consecutive lines with the same number of rows are stored as the nodes of a treap ordered by line
+class LineIndex {
+	struct Node {
+		Node* left;
+		Node* right;
+		guint32 priority;
+		std::size_t lines;
+		std::size_t rows;
+		std::size_t total_lines;
+		std::size_t total_rows;
+		Node(std::size_t lines, std::size_t rows): left(nullptr), right(nullptr), priority(g_random_int()), lines(lines), rows(rows), total_lines(lines), total_rows(lines * rows) {}
+	};
+	Node* root;
+	static std::size_t get_total_lines(const Node* node) {
+		return node ? node->total_lines : 0;
+	}
+	static std::size_t get_total_rows(const Node* node) {
+		return node ? node->total_rows : 0;
+	}
+	static Node* update(Node* node) {
+		node->total_lines = get_total_lines(node->left) + node->lines + get_total_lines(node->right);
+		node->total_rows = get_total_rows(node->left) + node->lines * node->rows + get_total_rows(node->right);
+		return node;
+	}
+	static Node* merge(Node* left, Node* right) {
+		if (!left) return right;
+		if (!right) return left;
+		if (left->priority > right->priority) {
+			left->right = merge(left->right, right);
+			return update(left);
+		}
+		else {
+			right->left = merge(left, right->left);
+			return update(right);
+		}
+	}
+	// splits the first `lines` lines of the tree off into `left`
+	static void split(Node* node, std::size_t lines, Node*& left, Node*& right) {
+		if (!node) {
+			left = right = nullptr;
+			return;
+		}
+		const std::size_t left_lines = get_total_lines(node->left);
+		if (lines <= left_lines) {
+			split(node->left, lines, left, node->left);
+			right = update(node);
+		}
+		else if (lines >= left_lines + node->lines) {
+			split(node->right, lines - left_lines - node->lines, node->right, right);
+			left = update(node);
+		}
+		else {
+			// the tail gets a priority of its own, so it is merged with the nodes after it instead of becoming their parent
+			Node* tail = new Node(left_lines + node->lines - lines, node->rows);
+			Node* old_right = node->right;
+			node->right = nullptr;
+			node->lines = lines - left_lines;
+			left = update(node);
+			right = merge(update(tail), old_right);
+		}
+	}
+	static void destroy(Node* node) {
+		if (node) {
+			destroy(node->left);
+			destroy(node->right);
+			delete node;
+		}
+	}
+	static std::size_t get_node_count(const Node* node) {
+		return node ? get_node_count(node->left) + 1 + get_node_count(node->right) : 0;
+	}
+public:
+	LineIndex(): root(nullptr) {}
+	LineIndex(const LineIndex&) = delete;
+	~LineIndex() {
+		destroy(root);
+	}
+	LineIndex& operator =(const LineIndex&) = delete;
+	std::size_t get_total_lines() const {
+		return get_total_lines(root);
+	}
+	std::size_t get_total_rows() const {
+		return get_total_rows(root);
+	}
+	std::size_t get_node_count() const {
+		return get_node_count(root);
+	}
+	std::size_t get_memory_usage() const {
+		return get_node_count(root) * sizeof(Node);
+	}
+	// forgets all measurements and assumes one row per line
+	void reset(std::size_t lines) {
+		destroy(root);
+		root = lines > 0 ? new Node(lines, 1) : nullptr;
+	}
+	void assign(std::size_t line, std::size_t lines, std::size_t rows) {
+		Node* left;
+		Node* middle;
+		Node* right;
+		split(root, line, left, right);
+		split(right, lines, middle, right);
+		destroy(middle);
+		root = merge(merge(left, new Node(lines, rows)), right);
+	}
+	void insert(std::size_t line, std::size_t lines) {
+		Node* left;
+		Node* right;
+		split(root, line, left, right);
+		root = merge(merge(left, new Node(lines, 1)), right);
+	}
+	void erase(std::size_t line, std::size_t lines) {
+		Node* left;
+		Node* middle;
+		Node* right;
+		split(root, line, left, right);
+		split(right, lines, middle, right);
+		destroy(middle);
+		root = merge(left, right);
+	}
+	// grows or shrinks the index to the given number of lines by inserting or erasing lines at `line`
+	void resize(std::size_t line, std::size_t lines) {
+		const std::size_t total_lines = get_total_lines();
+		line = std::min(line, total_lines);
+		if (lines > total_lines) {
+			insert(line, lines - total_lines);
+		}
+		else if (lines < total_lines) {
+			const std::size_t count = total_lines - lines;
+			erase(std::min(line, lines), count);
+		}
+	}
+	std::size_t get_rows(std::size_t line) const {
+		const Node* node = root;
+		while (node) {
+			const std::size_t left_lines = get_total_lines(node->left);
+			if (line < left_lines) {
+				node = node->left;
+			}
+			else if (line < left_lines + node->lines) {
+				return node->rows;
+			}
+			else {
+				line -= left_lines + node->lines;
+				node = node->right;
+			}
+		}
+		return 0;
+	}
+	std::size_t line_to_row(std::size_t line) const {
+		std::size_t row = 0;
+		const Node* node = root;
+		while (node) {
+			const std::size_t left_lines = get_total_lines(node->left);
+			if (line < left_lines) {
+				node = node->left;
+			}
+			else if (line < left_lines + node->lines) {
+				return row + get_total_rows(node->left) + (line - left_lines) * node->rows;
+			}
+			else {
+				line -= left_lines + node->lines;
+				row += get_total_rows(node->left) + node->lines * node->rows;
+				node = node->right;
+			}
+		}
+		return row;
+	}
+	// finds the line containing the given row and the row's offset within that line
+	bool row_to_line(std::size_t row, std::size_t& line, std::size_t& offset) const {
+		line = 0;
+		const Node* node = root;
+		while (node) {
+			const std::size_t left_rows = get_total_rows(node->left);
+			if (row < left_rows) {
+				node = node->left;
+			}
+			else if (row < left_rows + node->lines * node->rows) {
+				row -= left_rows;
+				line += get_total_lines(node->left) + row / node->rows;
+				offset = row % node->rows;
+				return true;
+			}
+			else {
+				row -= left_rows + node->lines * node->rows;
+				line += get_total_lines(node->left) + node->lines;
+				node = node->right;
+			}
+		}
+		return false;
+	}
+};
+
+struct PendingLatency {
+	gint64 frame_counter;
+	std::vector<gint64> input_times;
+	gint64 paint_time;
+};
+
+struct TraceReplay {
+	std::vector<TraceEvent> events;
+	std::size_t next_event;
+	bool max_speed;
+	gint64 start_time;
+	guint source_id;
+	gulong map_handler_id;
+	std::map<std::string, Histogram> event_histograms;
+	Histogram frame_histogram;
+	GTask* task;
 };
 
 typedef struct {
@@ -151,6 +727,12 @@ typedef struct {
 	GdkWindow* text_window;
 	GFile* file;
 	Editor* editor;
+	Journal* journal;
+	Encoding encoding;
+	bool bom;
+	bool lossy;
+	Compression compression;
+	GCancellable* load_cancellable;
 	PangoFontDescription* font_description;
 	double font_size;
 	double vertical_padding;
@@ -161,9 +743,25 @@ typedef struct {
 	GtkGesture* multipress_gesture;
 	GtkGesture* drag_gesture;
 	LayoutCache* layout_cache;
+	RowCache* row_cache;
+	LineIndex* line_index;
+	std::size_t first_visible_line;
+	std::map<std::size_t, std::size_t>* folds;
+	std::vector<TrackedCursor>* cursors;
+	bool wrap;
+	double wrap_width;
 	double gutter_width;
 	bool draw_cursors;
 	guint blink_source_id;
+	TraceWriter* trace_writer;
+	TraceReplay* trace_replay;
+	std::vector<gint64>* input_times;
+	// the time of the key press being handled, until an edit or cursor movement it causes is tagged
+	gint64 key_time;
+	std::vector<PendingLatency>* pending_latencies;
+	Histogram* latency_histogram;
+	GdkFrameClock* frame_clock;
+	gulong after_paint_handler_id;
 } PlatonEditorWidgetPrivate;
 
 G_DEFINE_TYPE_WITH_CODE(PlatonEditorWidget, platon_editor_widget, GTK_TYPE_WIDGET,
@@ -177,6 +775,7 @@ typedef enum {
 	PROP_VADJUSTMENT,
 	PROP_HSCROLL_POLICY,
 	PROP_VSCROLL_POLICY,
+	PROP_WRAP,
 	N_PROPERTIES
 } PlatonEditorWidgetProperty;
 
@@ -211,14 +810,462 @@ static void start_blinking(PlatonEditorWidget* self) {
 
 static void stop_blinking(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
-	if (priv->blink_source_id) {
-		g_source_remove(priv->blink_source_id);
-		priv->blink_source_id = 0;
+	if (priv->blink_source_id) {
+		g_source_remove(priv->blink_source_id);
+		priv->blink_source_id = 0;
+	}
+	if (priv->draw_cursors) {
+		priv->draw_cursors = false;
+		gtk_widget_queue_draw(GTK_WIDGET(self));
+	}
+}
+
+// returns the indentation in columns or -1 for blank lines
+static int get_indentation(const std::string& text) {
+	int indentation = 0;
+	for (char c: text) {
+		if (c == ' ') {
+			++indentation;
+		}
+		else if (c == '\t') {
+			indentation = (indentation / TAB_WIDTH + 1) * TAB_WIDTH;
+		}
+		else {
+			return indentation;
+		}
+	}
+	return -1;
+}
+
+// returns the number of lines after the given line that are indented deeper than the line itself
+static std::size_t get_fold_length(PlatonEditorWidgetPrivate* priv, std::size_t line) {
+	const int indentation = get_indentation(priv->editor->render(line).text);
+	if (indentation < 0) {
+		return 0;
+	}
+	const std::size_t total_lines = priv->editor->get_total_lines();
+	std::size_t last_line = line;
+	for (std::size_t start = line + 1; start < total_lines; start += SCAN_CHUNK) {
+		const auto lines = priv->editor->render(start, std::min(start + SCAN_CHUNK, total_lines));
+		for (std::size_t i = 0; i < lines.size(); ++i) {
+			const int line_indentation = get_indentation(lines[i].text);
+			if (line_indentation < 0) {
+				continue;
+			}
+			if (line_indentation <= indentation) {
+				return last_line - line;
+			}
+			last_line = start + i;
+		}
+	}
+	return last_line - line;
+}
+
+static void apply_folds(PlatonEditorWidgetPrivate* priv) {
+	for (const auto& fold: *priv->folds) {
+		priv->line_index->assign(fold.first + 1, fold.second, 0);
+	}
+}
+
+// adjusts the folds to an edit that replaced the lines after first up to last by the lines up to new_last: folds after the edit move, a fold that hides the whole edit or whose header holds a cursor of the edit grows or shrinks with it and any other fold that overlaps the edit is expanded
+static void move_folds(PlatonEditorWidgetPrivate* priv, std::size_t first, std::size_t last, std::size_t new_last, const std::vector<std::size_t>& cursor_lines) {
+	std::map<std::size_t, std::size_t> folds;
+	for (const auto& fold: *priv->folds) {
+		const std::size_t fold_last = fold.first + fold.second;
+		const bool header = std::find(cursor_lines.begin(), cursor_lines.end(), fold.first) != cursor_lines.end();
+		if (fold_last <= first) {
+			folds.insert(fold);
+		}
+		else if (fold.first >= last && !header) {
+			folds.emplace(fold.first + new_last - last, fold.second);
+		}
+		else if ((fold.first <= first || header) && fold_last >= last) {
+			if (fold_last + new_last > last + fold.first) {
+				folds.emplace(fold.first, fold.second + new_last - last);
+			}
+		}
+		else {
+			priv->line_index->assign(fold.first + 1, fold.second, 1);
+		}
+	}
+	*priv->folds = std::move(folds);
+}
+
+// expands the folds that hide a cursor so that the text being edited is always visible
+static void reveal_cursors(PlatonEditorWidgetPrivate* priv) {
+	bool expanded = false;
+	for (const TrackedCursor& cursor: *priv->cursors) {
+		const std::size_t line = cursor.line;
+		for (auto iter = priv->folds->begin(); iter != priv->folds->end() && iter->first < line;) {
+			if (line <= iter->first + iter->second) {
+				priv->line_index->assign(iter->first + 1, iter->second, 1);
+				iter = priv->folds->erase(iter);
+				expanded = true;
+			}
+			else {
+				++iter;
+			}
+		}
+	}
+	if (expanded) {
+		// folds nested in the expanded ones that do not hide a cursor stay collapsed
+		apply_folds(priv);
+	}
+}
+
+static void update(PlatonEditorWidget* self);
+
+// remembers the time of every input that changed the editor and has not been drawn yet, so that each keystroke of a burst is measured once;
+// keys that change nothing, such as dead keys, are not measured, and input that doesn't come from a key press, such as a delayed paste, is timed when it is applied
+static void tag_input(PlatonEditorWidgetPrivate* priv) {
+	priv->input_times->push_back(priv->key_time ? priv->key_time : g_get_monotonic_time());
+	priv->key_time = 0;
+}
+
+// whether a fold marker is drawn next to the given line, which is visible
+static bool has_fold_marker(PlatonEditorWidgetPrivate* priv, std::size_t line) {
+	if (priv->folds->count(line) > 0) {
+		return true;
+	}
+	if (line + 1 >= priv->editor->get_total_lines()) {
+		return false;
+	}
+	const auto lines = priv->editor->render(line, line + 2);
+	const int indentation = get_indentation(lines[0].text);
+	return indentation >= 0 && get_indentation(lines[1].text) > indentation;
+}
+
+static void toggle_fold(PlatonEditorWidget* self, std::size_t line) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	auto iter = priv->folds->find(line);
+	if (iter != priv->folds->end()) {
+		const std::size_t length = iter->second;
+		priv->folds->erase(iter);
+		priv->line_index->assign(line + 1, length, 1);
+		// folds nested in the expanded fold stay collapsed
+		for (iter = priv->folds->upper_bound(line); iter != priv->folds->end() && iter->first <= line + length; ++iter) {
+			priv->line_index->assign(iter->first + 1, iter->second, 0);
+		}
+	}
+	else {
+		const std::size_t length = get_fold_length(priv, line);
+		if (length == 0) {
+			return;
+		}
+		priv->folds->emplace(line, length);
+		priv->line_index->assign(line + 1, length, 0);
+	}
+	update(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+struct LineRange {
+	std::size_t first;
+	std::size_t last;
+};
+
+// the lines an edit can change around one or more cursors: the lines of their selections, with one more line on each side for edits that join lines
+struct EditRange {
+	std::size_t first;
+	std::size_t last;
+	std::ptrdiff_t delta;
+	std::vector<std::size_t> cursor_lines;
+};
+
+struct EditScope {
+	std::vector<EditRange> ranges;
+	std::size_t total_lines;
+	// whether the number of lines each range gains or loses is known, otherwise everything between the first and the last range is measured again
+	bool deltas_known;
+};
+
+static bool selection_reaches_start(const RenderedLine& line) {
+	for (const Range& selection: line.selections) {
+		if (selection.start == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool selection_reaches_end(const RenderedLine& line) {
+	for (const Range& selection: line.selections) {
+		if (selection.end >= line.text.size()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// follows the selections of the given line across line boundaries; this renders every selected line and is only used when the cursors are not known
+static LineRange get_selection_extent(PlatonEditorWidgetPrivate* priv, std::size_t line) {
+	const std::size_t total_lines = priv->editor->get_total_lines();
+	const RenderedLine rendered_line = priv->editor->render(line);
+	LineRange range = {line, line};
+	bool continues = selection_reaches_start(rendered_line);
+	while (continues && range.first > 0) {
+		const std::size_t start = range.first - std::min<std::size_t>(range.first, SCAN_CHUNK);
+		const auto lines = priv->editor->render(start, range.first);
+		for (std::size_t i = lines.size(); i-- > 0 && continues;) {
+			continues = selection_reaches_end(lines[i]);
+			if (continues) {
+				range.first = start + i;
+				continues = selection_reaches_start(lines[i]);
+			}
+		}
+	}
+	continues = selection_reaches_end(rendered_line);
+	while (continues && range.last + 1 < total_lines) {
+		const std::size_t start = range.last + 1;
+		const auto lines = priv->editor->render(start, std::min(start + SCAN_CHUNK, total_lines));
+		for (std::size_t i = 0; i < lines.size() && continues; ++i) {
+			continues = selection_reaches_start(lines[i]);
+			if (continues) {
+				range.last = start + i;
+				continues = selection_reaches_end(lines[i]);
+			}
+		}
+	}
+	return range;
+}
+
+// returns the line of every cursor within the given ranges in ascending order, or of every cursor in the document if there are none
+static std::vector<std::size_t> find_cursor_lines(PlatonEditorWidgetPrivate* priv, std::vector<LineRange> ranges) {
+	const std::size_t total_lines = priv->editor->get_total_lines();
+	std::vector<std::size_t> cursor_lines;
+	auto scan = [&](std::size_t first, std::size_t end) {
+		for (std::size_t start = first; start < end; start += SCAN_CHUNK) {
+			const auto lines = priv->editor->render(start, std::min(start + SCAN_CHUNK, end));
+			for (std::size_t i = 0; i < lines.size(); ++i) {
+				cursor_lines.insert(cursor_lines.end(), lines[i].cursors.size(), start + i);
+			}
+		}
+	};
+	std::sort(ranges.begin(), ranges.end(), [](const LineRange& a, const LineRange& b) {
+		return a.first < b.first;
+	});
+	std::size_t end = 0;
+	for (const LineRange& range: ranges) {
+		scan(std::min(std::max(range.first, end), total_lines), std::min(range.last + 1, total_lines));
+		end = std::max(end, range.last + 1);
+	}
+	if (cursor_lines.empty()) {
+		scan(0, total_lines);
+	}
+	return cursor_lines;
+}
+
+// moves the tracked cursors to the lines they were found on; cursors keep their order, so they are matched in the order of their lines
+static void move_cursors(PlatonEditorWidgetPrivate* priv, const std::vector<std::size_t>& lines, bool keep_anchors) {
+	std::vector<TrackedCursor>& cursors = *priv->cursors;
+	std::vector<std::size_t> order(cursors.size());
+	for (std::size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+		return cursors[a].line < cursors[b].line;
+	});
+	if (lines.size() == cursors.size()) {
+		for (std::size_t i = 0; i < order.size(); ++i) {
+			TrackedCursor& cursor = cursors[order[i]];
+			cursor.line = lines[i];
+			if (!keep_anchors) {
+				cursor.anchor = cursor.line;
+			}
+		}
+		return;
+	}
+	// cursors have been merged: every cursor that is left takes the anchor of the closest cursor above it
+	std::vector<TrackedCursor> moved;
+	std::size_t next = 0;
+	for (std::size_t line: lines) {
+		while (next + 1 < order.size() && cursors[order[next + 1]].line <= line) {
+			++next;
+		}
+		moved.push_back({line, keep_anchors && !order.empty() ? cursors[order[next]].anchor : line});
+	}
+	cursors = std::move(moved);
+}
+
+// finds the cursors anywhere in the document, for example after a journal has been replayed
+static void reset_cursors(PlatonEditorWidgetPrivate* priv) {
+	priv->cursors->clear();
+	for (std::size_t line: find_cursor_lines(priv, {{0, 0}})) {
+		const LineRange extent = get_selection_extent(priv, line);
+		priv->cursors->push_back({line, extent.first < line ? extent.first : extent.last});
+	}
+}
+
+// the lines that each cursor can move to: the lines next to it and, if its selection collapses, the lines next to its anchor
+static std::vector<LineRange> begin_move(PlatonEditorWidgetPrivate* priv, bool extend_selection) {
+	std::vector<LineRange> ranges;
+	for (const TrackedCursor& cursor: *priv->cursors) {
+		ranges.push_back({cursor.line > 0 ? cursor.line - 1 : 0, cursor.line + 1});
+		if (!extend_selection && cursor.anchor != cursor.line) {
+			ranges.push_back({cursor.anchor > 0 ? cursor.anchor - 1 : 0, cursor.anchor + 1});
+		}
+	}
+	return ranges;
+}
+
+static void end_move(PlatonEditorWidget* self, const std::vector<LineRange>& ranges, bool extend_selection) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	move_cursors(priv, find_cursor_lines(priv, ranges), extend_selection);
+	reveal_cursors(priv);
+	update(self);
+	tag_input(priv);
+}
+
+// the number of lines that an operation inserts or removes at each cursor; the selection is replaced, so all of its lines but one are removed
+static EditScope begin_edit(PlatonEditorWidgetPrivate* priv, JournalOp op, const char* text = NULL) {
+	EditScope scope;
+	scope.total_lines = priv->editor->get_total_lines();
+	scope.deltas_known = true;
+	std::vector<TrackedCursor> cursors = *priv->cursors;
+	std::sort(cursors.begin(), cursors.end(), [](const TrackedCursor& a, const TrackedCursor& b) {
+		return a.line < b.line;
+	});
+	const std::ptrdiff_t inserted_lines = text ? std::count(text, text + std::strlen(text), '\n') : 0;
+	for (std::size_t i = 0; i < cursors.size(); ++i) {
+		const TrackedCursor& cursor = cursors[i];
+		if (cursor.line >= scope.total_lines || cursor.anchor >= scope.total_lines) {
+			continue;
+		}
+		const std::size_t first = std::min(cursor.line, cursor.anchor);
+		const std::size_t last = std::max(cursor.line, cursor.anchor);
+		std::ptrdiff_t delta = first - last;
+		switch (op) {
+		case JournalOp::INSERT_TEXT:
+		case JournalOp::PASTE:
+			delta += inserted_lines;
+			break;
+		case JournalOp::INSERT_NEWLINE:
+			delta += 1;
+			break;
+		case JournalOp::DELETE_BACKWARD:
+		case JournalOp::DELETE_FORWARD:
+		case JournalOp::CUT:
+			// without a selection that spans lines, whether lines are joined depends on where the cursors are in their line
+			if (first == last && (i == 0 || cursors[i - 1].line != cursor.line)) {
+				const RenderedLine line = priv->editor->render(cursor.line);
+				for (std::size_t column: line.cursors) {
+					bool selection = false;
+					for (const Range& range: line.selections) {
+						selection = selection || (range.start != range.end && (range.start == column || range.end == column));
+					}
+					if (selection) {
+						continue;
+					}
+					if (op == JournalOp::CUT) {
+						scope.deltas_known = false;
+					}
+					else if (op == JournalOp::DELETE_BACKWARD ? column == 0 && cursor.line > 0 : column >= line.text.size() && cursor.line + 1 < scope.total_lines) {
+						delta -= 1;
+					}
+				}
+			}
+			break;
+		default:
+			break;
+		}
+		EditRange range = {first > 0 ? first - 1 : 0, std::min(last + 1, scope.total_lines - 1), delta, {cursor.line}};
+		if (!scope.ranges.empty() && range.first <= scope.ranges.back().last) {
+			scope.ranges.back().last = std::max(scope.ranges.back().last, range.last);
+			scope.ranges.back().delta += range.delta;
+			scope.ranges.back().cursor_lines.push_back(cursor.line);
+		}
+		else {
+			scope.ranges.push_back(range);
+		}
+	}
+	return scope;
+}
+
+// replaces the lines after first up to last by the lines up to new_last in the line index; the first line keeps its measurement and the others are measured again when they are drawn
+static void splice_lines(PlatonEditorWidgetPrivate* priv, std::size_t first, std::size_t last, std::size_t new_last, const std::vector<std::size_t>& cursor_lines) {
+	move_folds(priv, first, last, new_last, cursor_lines);
+	if (last > first) {
+		priv->line_index->erase(first + 1, last - first);
+	}
+	if (new_last > first) {
+		priv->line_index->insert(first + 1, new_last - first);
+	}
+}
+
+// applies the lines that an edit inserted or removed to the line index, range by range, and finds the cursors again
+static void end_edit(PlatonEditorWidget* self, EditScope scope) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::size_t total_lines = priv->editor->get_total_lines();
+	std::ptrdiff_t total_delta = 0;
+	for (const EditRange& range: scope.ranges) {
+		total_delta += range.delta;
+	}
+	if (!scope.ranges.empty() && (!scope.deltas_known || (std::ptrdiff_t)(total_lines - scope.total_lines) != total_delta)) {
+		// the lines were not inserted or removed as expected, so everything between the first and the last range is taken to have changed
+		EditRange range = {scope.ranges.front().first, scope.ranges.back().last, (std::ptrdiff_t)(total_lines - scope.total_lines), {}};
+		for (const EditRange& cursor_range: scope.ranges) {
+			range.cursor_lines.insert(range.cursor_lines.end(), cursor_range.cursor_lines.begin(), cursor_range.cursor_lines.end());
+		}
+		scope.ranges.assign(1, range);
+	}
+	bool changed = false;
+	bool valid = true;
+	for (const EditRange& range: scope.ranges) {
+		changed = changed || range.delta != 0;
+		// otherwise the line index no longer matches and update measures everything again
+		valid = valid && (std::ptrdiff_t)(range.last - range.first) + range.delta >= 0;
+	}
+	if (changed && valid) {
+		// from the last range to the first, so that the ranges before the one being spliced keep their lines
+		for (auto iter = scope.ranges.rbegin(); iter != scope.ranges.rend(); ++iter) {
+			splice_lines(priv, iter->first, iter->last, iter->last + iter->delta, iter->cursor_lines);
+		}
+		apply_folds(priv);
+	}
+	std::vector<LineRange> ranges;
+	std::ptrdiff_t offset = 0;
+	for (const EditRange& range: scope.ranges) {
+		ranges.push_back({range.first + offset, range.last + offset + range.delta});
+		offset += range.delta;
+	}
+	move_cursors(priv, find_cursor_lines(priv, ranges), false);
+	reveal_cursors(priv);
+	update(self);
+	tag_input(priv);
+}
+
+// updates the tracked cursors after a cursor has been placed with the pointer
+static void place_cursor(PlatonEditorWidget* self, JournalOp op, std::size_t line) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	std::vector<TrackedCursor>& cursors = *priv->cursors;
+	if (op == JournalOp::SET_CURSOR || cursors.empty()) {
+		cursors.assign(1, {line, line});
 	}
-	if (priv->draw_cursors) {
-		priv->draw_cursors = false;
-		gtk_widget_queue_draw(GTK_WIDGET(self));
+	else if (op == JournalOp::TOGGLE_CURSOR) {
+		// toggling adds a cursor or removes the one at the given position
+		const std::size_t count = priv->editor->render(line).cursors.size();
+		const std::size_t tracked_count = std::count_if(cursors.begin(), cursors.end(), [&](const TrackedCursor& cursor) {
+			return cursor.line == line;
+		});
+		if (count > tracked_count) {
+			cursors.push_back({line, line});
+		}
+		else if (count < tracked_count) {
+			for (auto iter = cursors.end(); iter != cursors.begin();) {
+				--iter;
+				if (iter->line == line) {
+					cursors.erase(iter);
+					break;
+				}
+			}
+		}
+	}
+	else {
+		// the selection of the last cursor is extended
+		cursors.back().line = line;
 	}
+	reveal_cursors(priv);
+	update(self);
 }
 
 static void update(PlatonEditorWidget* self) {
@@ -227,18 +1274,34 @@ static void update(PlatonEditorWidget* self) {
 		const double gutter_width = std::round(priv->char_width * count_digits(priv->editor->get_total_lines()) + priv->font_size * (HORIZONTAL_PADDING * 2.0));
 		if (gutter_width != priv->gutter_width) {
 			priv->gutter_width = gutter_width;
+			priv->row_cache->clear();
 			GtkAllocation allocation;
 			gtk_widget_get_allocation(GTK_WIDGET(self), &allocation);
 			gdk_window_move_resize(priv->text_window, allocation.x + gutter_width, allocation.y, allocation.width - gutter_width, allocation.height);
 		}
+		double value = gtk_adjustment_get_value(priv->vadjustment);
+		const double wrap_width = priv->wrap ? std::max(gtk_widget_get_allocated_width(GTK_WIDGET(self)) - priv->gutter_width, 1.0) : -1.0;
+		if (wrap_width != priv->wrap_width) {
+			// all lines have to be measured again; keep the first visible line at the top
+			priv->wrap_width = wrap_width;
+			priv->row_cache->clear();
+			priv->line_index->reset(priv->editor->get_total_lines());
+			apply_folds(priv);
+			value = priv->line_index->line_to_row(priv->first_visible_line) * priv->line_height;
+		}
+		else if (priv->line_index->get_total_lines() != priv->editor->get_total_lines()) {
+			// the document changed outside of an edit, for example by a replayed journal, so there is no telling which lines moved
+			priv->folds->clear();
+			priv->line_index->reset(priv->editor->get_total_lines());
+		}
 		const double page_size = gtk_widget_get_allocated_height(GTK_WIDGET(self));
-		const double upper = std::max(priv->editor->get_total_lines() * priv->line_height + priv->vertical_padding * 2.0, page_size);
+		const double upper = std::max(priv->line_index->get_total_rows() * priv->line_height + priv->vertical_padding * 2.0, page_size);
 		const double max_value = std::max(upper - page_size, 0.0);
 		g_object_freeze_notify(G_OBJECT(priv->vadjustment));
 		gtk_adjustment_set_page_size(priv->vadjustment, page_size);
 		gtk_adjustment_set_upper(priv->vadjustment, upper);
-		if (gtk_adjustment_get_value(priv->vadjustment) > max_value) {
-			gtk_adjustment_set_value(priv->vadjustment, max_value);
+		if (value != gtk_adjustment_get_value(priv->vadjustment) || value > max_value) {
+			gtk_adjustment_set_value(priv->vadjustment, std::min(value, max_value));
 		}
 		g_object_thaw_notify(G_OBJECT(priv->vadjustment));
 	}
@@ -260,12 +1323,29 @@ static void platon_editor_widget_get_property(GObject* object, guint property_id
 	case PROP_VSCROLL_POLICY:
 		g_value_set_enum(value, priv->vscroll_policy);
 		break;
+	case PROP_WRAP:
+		g_value_set_boolean(value, priv->wrap);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 		break;
 	}
 }
 
+static void record_scroll(GtkAdjustment* adjustment, gpointer user_data) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(PLATON_EDITOR_WIDGET(user_data));
+	priv->trace_writer->scroll(gtk_adjustment_get_value(adjustment));
+}
+
+// press and drag events are recorded in widget coordinates, so the scroll position they are relative to is recorded as well, starting with the current one
+static void record_scrolling(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->vadjustment) {
+		g_signal_connect_object(priv->vadjustment, "value-changed", G_CALLBACK(record_scroll), self, G_CONNECT_DEFAULT);
+		record_scroll(priv->vadjustment, self);
+	}
+}
+
 static void platon_editor_widget_set_property(GObject* object, guint property_id, const GValue* value, GParamSpec* pspec) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(object);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
@@ -275,6 +1355,9 @@ static void platon_editor_widget_set_property(GObject* object, guint property_id
 		break;
 	case PROP_VADJUSTMENT:
 		priv->vadjustment = GTK_ADJUSTMENT(g_value_get_object(value));
+		if (priv->trace_writer) {
+			record_scrolling(self);
+		}
 		update(self);
 		break;
 	case PROP_HSCROLL_POLICY:
@@ -283,12 +1366,46 @@ static void platon_editor_widget_set_property(GObject* object, guint property_id
 	case PROP_VSCROLL_POLICY:
 		priv->vscroll_policy = (GtkScrollablePolicy)g_value_get_enum(value);
 		break;
+	case PROP_WRAP:
+		priv->wrap = g_value_get_boolean(value);
+		update(self);
+		gtk_widget_queue_draw(GTK_WIDGET(self));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 		break;
 	}
 }
 
+// the latency of an input ends with the presentation of the first frame that includes it, or with its paint if the backend does not report presentation times
+static void handle_after_paint(GdkFrameClock* frame_clock, gpointer user_data) {
+	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const gint64 now = g_get_monotonic_time();
+	std::vector<PendingLatency>& pending_latencies = *priv->pending_latencies;
+	for (auto iter = pending_latencies.begin(); iter != pending_latencies.end();) {
+		if (!iter->paint_time) {
+			iter->paint_time = now;
+		}
+		GdkFrameTimings* timings = gdk_frame_clock_get_timings(frame_clock, iter->frame_counter);
+		if (timings && !gdk_frame_timings_get_complete(timings)) {
+			++iter;
+			continue;
+		}
+		const gint64 presentation_time = timings ? gdk_frame_timings_get_presentation_time(timings) : 0;
+		for (gint64 input_time: iter->input_times) {
+			const gint64 latency = (presentation_time ? presentation_time : iter->paint_time) - input_time;
+			priv->latency_histogram->add(latency);
+			g_debug("input latency: %" G_GINT64_FORMAT " us (%s)", latency, presentation_time ? "presented" : "painted");
+		}
+		iter = pending_latencies.erase(iter);
+	}
+	if (!pending_latencies.empty()) {
+		// the timings of a frame are completed after it has been presented
+		gdk_frame_clock_request_phase(frame_clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+	}
+}
+
 static void platon_editor_widget_realize(GtkWidget* widget) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(widget);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
@@ -316,11 +1433,17 @@ static void platon_editor_widget_realize(GtkWidget* widget) {
 	gdk_window_set_cursor(priv->text_window, cursor);
 	g_object_unref(cursor);
 	gtk_im_context_set_client_window(priv->im_context, priv->text_window);
+	priv->frame_clock = gtk_widget_get_frame_clock(widget);
+	priv->after_paint_handler_id = g_signal_connect(priv->frame_clock, "after-paint", G_CALLBACK(handle_after_paint), self);
 }
 
 static void platon_editor_widget_unrealize(GtkWidget* widget) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(widget);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	g_signal_handler_disconnect(priv->frame_clock, priv->after_paint_handler_id);
+	priv->frame_clock = NULL;
+	priv->after_paint_handler_id = 0;
+	priv->pending_latencies->clear();
 	gtk_widget_unregister_window(widget, priv->text_window);
 	gdk_window_destroy(priv->text_window);
 	GdkWindow* window = gtk_widget_get_window(widget);
@@ -352,74 +1475,159 @@ static gboolean platon_editor_widget_focus_out_event(GtkWidget* widget, GdkEvent
 	return GDK_EVENT_PROPAGATE;
 }
 
+static void record_frame(PlatonEditorWidgetPrivate* priv, gint64 start_time) {
+	if (priv->trace_replay) {
+		priv->trace_replay->frame_histogram.add(g_get_monotonic_time() - start_time);
+	}
+}
+
 static gboolean platon_editor_widget_draw(GtkWidget* widget, cairo_t* cr) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(widget);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const gint64 draw_start_time = g_get_monotonic_time();
 	priv->layout_cache->increment_generation();
+	priv->row_cache->increment_generation();
 	PangoContext* pango_context = gtk_widget_get_pango_context(GTK_WIDGET(self));
 	const double allocated_width = gtk_widget_get_allocated_width(widget);
 	const double allocated_height = gtk_widget_get_allocated_height(widget);
 	const double vadjustment = gtk_adjustment_get_value(priv->vadjustment);
-	const double max_row = priv->editor->get_total_lines();
+	const double max_row = priv->line_index->get_total_rows();
 	const size_t start_row = std::clamp(std::floor(vadjustment / priv->line_height), 0.0, max_row);
 	const size_t end_row = std::clamp(std::ceil((allocated_height + vadjustment) / priv->line_height), 0.0, max_row);
 	const Theme& theme = priv->editor->get_theme();
-	const auto lines = priv->editor->render(start_row, end_row);
 	// background
 	set_source(cr, theme.background);
 	cairo_paint(cr);
 	set_source(cr, theme.gutter_background);
 	cairo_rectangle(cr, 0.0, 0.0, priv->gutter_width, allocated_height);
 	cairo_fill(cr);
-	for (size_t row = start_row; row < end_row; ++row) {
+	// collect the visible lines, skipping folded ones
+	std::vector<std::size_t> visible_lines;
+	std::size_t offset = 0;
+	for (size_t row = start_row; row < end_row;) {
+		std::size_t line, line_offset;
+		if (!priv->line_index->row_to_line(row, line, line_offset)) {
+			break;
+		}
+		if (visible_lines.empty()) {
+			offset = line_offset;
+		}
+		visible_lines.push_back(line);
+		row += priv->line_index->get_rows(line) - line_offset;
+	}
+	if (visible_lines.empty()) {
+		priv->row_cache->collect_garbage();
+		priv->layout_cache->collect_garbage();
+		record_frame(priv, draw_start_time);
+		return GDK_EVENT_STOP;
+	}
+	priv->first_visible_line = visible_lines.front();
+	if (!priv->input_times->empty()) {
+		priv->pending_latencies->push_back({gdk_frame_clock_get_frame_counter(gtk_widget_get_frame_clock(widget)), std::move(*priv->input_times), 0});
+		priv->input_times->clear();
+	}
+	// only render the visible lines, in contiguous runs
+	std::vector<RenderedLine> lines;
+	for (std::size_t i = 0; i < visible_lines.size();) {
+		std::size_t j = i + 1;
+		while (j < visible_lines.size() && visible_lines[j] == visible_lines[j - 1] + 1) {
+			++j;
+		}
+		const auto run = priv->editor->render(visible_lines[i], visible_lines[j - 1] + 1);
+		lines.insert(lines.end(), run.begin(), run.end());
+		i = j;
+	}
+	priv->layout_cache->prefetch(pango_context, priv->font_description, theme, lines, priv->wrap_width);
+	const double marker_x = priv->gutter_width - std::round(priv->font_size * HORIZONTAL_PADDING) / 2.0 - priv->char_width / 2.0;
+	bool measured = false;
+	size_t row = start_row - offset;
+	for (std::size_t i = 0; i < visible_lines.size() && row < end_row; ++i) {
+		const std::size_t line = visible_lines[i];
+		const RenderedLine& rendered_line = lines[i];
 		const double y = priv->vertical_padding + row * priv->line_height - vadjustment;
-		const bool is_active = lines[row - start_row].cursors.size() > 0 || lines[row - start_row].selections.size() > 0;
-		if (is_active) {
-			set_source(cr, theme.background_active);
-			cairo_rectangle(cr, 0.0, y, allocated_width, priv->line_height);
-			cairo_fill(cr);
-			set_source(cr, theme.gutter_background_active);
-			cairo_rectangle(cr, 0.0, y, priv->gutter_width, priv->line_height);
-			cairo_fill(cr);
+		Layout layout = priv->layout_cache->get_layout(pango_context, priv->font_description, theme, rendered_line, priv->wrap_width);
+		const std::size_t rows = layout.get_rows();
+		if (rows != priv->line_index->get_rows(line)) {
+			priv->line_index->assign(line, 1, rows);
+			measured = true;
 		}
-		Layout layout = priv->layout_cache->get_layout(pango_context, priv->font_description, theme, lines[row - start_row]);
-		// selections
-		set_source(cr, theme.selection);
-		for (const Range& selection: lines[row - start_row].selections) {
-			const double x = layout.index_to_x(selection.start);
-			const double width = layout.index_to_x(selection.end) - x;
-			cairo_rectangle(cr, priv->gutter_width + x, y, width, priv->line_height);
+		const double height = rows * priv->line_height;
+		const bool is_active = rendered_line.cursors.size() > 0 || rendered_line.selections.size() > 0;
+		cairo_surface_t* row_surface = priv->row_cache->get_row(gtk_widget_get_window(widget), rendered_line, is_active, allocated_width, height, [&](cairo_t* cr) {
+			// background; the row is opaque, so text keeps subpixel antialiasing
+			set_source(cr, is_active ? theme.background_active : theme.background);
+			cairo_paint(cr);
+			set_source(cr, is_active ? theme.gutter_background_active : theme.gutter_background);
+			cairo_rectangle(cr, 0.0, 0.0, priv->gutter_width, height);
 			cairo_fill(cr);
-		}
-		// text
-		layout.draw(cr, theme, priv->gutter_width, y + priv->ascent);
-		// line number
+			// selections
+			set_source(cr, theme.selection);
+			for (const Range& selection: rendered_line.selections) {
+				layout.for_each_range(selection.start, selection.end, [&](std::size_t row, double start_x, double end_x) {
+					cairo_rectangle(cr, priv->gutter_width + start_x, row * priv->line_height, end_x - start_x, priv->line_height);
+					cairo_fill(cr);
+				});
+			}
+			// text
+			layout.draw(cr, theme, Style::DEFAULT, rendered_line.spans, priv->gutter_width, priv->ascent, priv->line_height);
+			// line number
+			{
+				Layout layout = priv->layout_cache->get_layout(pango_context, priv->font_description, theme, rendered_line.number);
+				const double x = priv->gutter_width - std::round(priv->font_size * HORIZONTAL_PADDING);
+				layout.draw(cr, theme, is_active ? Style::LINE_NUMBER_ACTIVE : Style::LINE_NUMBER, std::vector<Span>(), x, priv->ascent, priv->line_height, true);
+			}
+		});
+		cairo_set_source_surface(cr, row_surface, 0.0, y);
+		cairo_rectangle(cr, 0.0, y, allocated_width, height);
+		cairo_fill(cr);
+		// fold marker
 		{
-			Layout layout = priv->layout_cache->get_layout(pango_context, priv->font_description, theme, lines[row - start_row].number, is_active);
-			const double x = priv->gutter_width - std::round(priv->font_size * HORIZONTAL_PADDING);
-			layout.draw(cr, theme, x, y + priv->ascent, true);
+			const bool folded = priv->folds->count(line) > 0;
+			bool foldable = false;
+			if (!folded && i + 1 < visible_lines.size() && visible_lines[i + 1] == line + 1) {
+				const int indentation = get_indentation(rendered_line.text);
+				const int next_indentation = get_indentation(lines[i + 1].text);
+				foldable = indentation >= 0 && next_indentation > indentation;
+			}
+			if (folded || foldable) {
+				Layout layout = priv->layout_cache->get_layout(pango_context, priv->font_description, theme, folded ? "\u25B8" : "\u25BE", std::vector<Span>(), -1.0);
+				layout.draw(cr, theme, Style::LINE_NUMBER, std::vector<Span>(), marker_x, y + priv->ascent, priv->line_height);
+			}
 		}
 		// cursors
 		if (priv->draw_cursors) {
 			set_source(cr, theme.cursor);
-			for (std::size_t cursor: lines[row - start_row].cursors) {
-				const double x = priv->gutter_width + layout.index_to_x(cursor);
-				cairo_rectangle(cr, x - 1.0, y, 2.0, priv->line_height);
+			for (std::size_t cursor: rendered_line.cursors) {
+				std::size_t cursor_row;
+				const double x = priv->gutter_width + layout.index_to_x(cursor, &cursor_row);
+				cairo_rectangle(cr, x - 1.0, y + cursor_row * priv->line_height, 2.0, priv->line_height);
 				cairo_fill(cr);
 			}
 		}
+		row += rows;
+	}
+	if (measured) {
+		// the scroll extent depends on the measured number of rows
+		update(self);
+		gtk_widget_queue_draw(widget);
 	}
+	priv->row_cache->collect_garbage();
 	priv->layout_cache->collect_garbage();
+	record_frame(priv, draw_start_time);
 	return GDK_EVENT_STOP;
 }
 
 static gboolean platon_editor_widget_key_press_event(GtkWidget* widget, GdkEventKey* event) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(widget);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
-	if (GTK_WIDGET_CLASS(platon_editor_widget_parent_class)->key_press_event(widget, event) || gtk_im_context_filter_keypress(priv->im_context, event)) {
-		return GDK_EVENT_STOP;
+	if (priv->load_cancellable) {
+		return GDK_EVENT_PROPAGATE;
 	}
-	return GDK_EVENT_PROPAGATE;
+	// the event time is in the windowing system's clock, so the input is timed when it is received
+	priv->key_time = g_get_monotonic_time();
+	const bool handled = GTK_WIDGET_CLASS(platon_editor_widget_parent_class)->key_press_event(widget, event) || gtk_im_context_filter_keypress(priv->im_context, event);
+	priv->key_time = 0;
+	return handled ? GDK_EVENT_STOP : GDK_EVENT_PROPAGATE;
 }
 
 static gboolean platon_editor_widget_key_release_event(GtkWidget* widget, GdkEventKey* event) {
@@ -434,123 +1642,183 @@ static gboolean platon_editor_widget_key_release_event(GtkWidget* widget, GdkEve
 static void handle_commit(GtkIMContext* im_context, gchar* text, gpointer user_data) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->trace_writer) priv->trace_writer->commit(text);
+	const EditScope scope = begin_edit(priv, JournalOp::INSERT_TEXT, text);
 	priv->editor->insert_text(text);
-	update(self);
+	priv->journal->record(JournalOp::INSERT_TEXT, text);
+	end_edit(self, scope);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
-static void handle_pressed(GtkGestureMultiPress* multipress_gesture, gint n_press, gdouble x, gdouble y, gpointer user_data) {
-	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
+static void press(PlatonEditorWidget* self, double x, double y, GdkModifierType state) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
 	const double vadjustment = gtk_adjustment_get_value(priv->vadjustment);
 	gtk_widget_grab_focus(GTK_WIDGET(self));
-	GdkEventSequence* sequence = gtk_gesture_single_get_current_sequence(GTK_GESTURE_SINGLE(multipress_gesture));
-	const GdkEvent* event = gtk_gesture_get_last_event(GTK_GESTURE(multipress_gesture), sequence);
-	GdkModifierType state;
-	gdk_event_get_state(event, &state);
 	const bool modify_selection = state & gtk_widget_get_modifier_mask(GTK_WIDGET(self), GDK_MODIFIER_INTENT_MODIFY_SELECTION);
 	const bool extend_selection = state & gtk_widget_get_modifier_mask(GTK_WIDGET(self), GDK_MODIFIER_INTENT_EXTEND_SELECTION);
-	const std::size_t line = std::max((y + vadjustment - priv->vertical_padding) / priv->line_height, 0.0);
-	if (line < priv->editor->get_total_lines()) {
-		Layout layout = priv->layout_cache->get_layout(gtk_widget_get_pango_context(GTK_WIDGET(self)), priv->font_description, priv->editor->get_theme(), priv->editor->render(line));
-		const std::size_t column = layout.x_to_index(x - priv->gutter_width);
+	const std::size_t row = std::max((y + vadjustment - priv->vertical_padding) / priv->line_height, 0.0);
+	std::size_t line, offset;
+	if (priv->line_index->row_to_line(row, line, offset)) {
+		if (offset == 0 && x >= priv->gutter_width - std::round(priv->font_size * HORIZONTAL_PADDING) && x < priv->gutter_width && has_fold_marker(priv, line)) {
+			// fold marker
+			toggle_fold(self, line);
+			return;
+		}
+		Layout layout = priv->layout_cache->get_layout(gtk_widget_get_pango_context(GTK_WIDGET(self)), priv->font_description, priv->editor->get_theme(), priv->editor->render(line), priv->wrap_width);
+		const std::size_t column = layout.x_to_index(x - priv->gutter_width, offset);
+		JournalOp op;
 		if (extend_selection) {
 			priv->editor->extend_selection(column, line);
+			op = JournalOp::EXTEND_SELECTION;
 		}
 		else {
 			if (modify_selection) {
 				priv->editor->toggle_cursor(column, line);
+				op = JournalOp::TOGGLE_CURSOR;
 			}
 			else {
 				priv->editor->set_cursor(column, line);
+				op = JournalOp::SET_CURSOR;
 			}
 		}
+		priv->journal->record(op, column, line);
+		place_cursor(self, op, line);
 		gtk_widget_queue_draw(GTK_WIDGET(self));
 		start_blinking(self);
 	}
 }
 
-static void handle_drag_update(GtkGestureDrag* drag_gesture, gdouble offset_x, gdouble offset_y, gpointer user_data) {
+static void handle_pressed(GtkGestureMultiPress* multipress_gesture, gint n_press, gdouble x, gdouble y, gpointer user_data) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	GdkEventSequence* sequence = gtk_gesture_single_get_current_sequence(GTK_GESTURE_SINGLE(multipress_gesture));
+	const GdkEvent* event = gtk_gesture_get_last_event(GTK_GESTURE(multipress_gesture), sequence);
+	GdkModifierType state;
+	gdk_event_get_state(event, &state);
+	if (priv->load_cancellable) {
+		return;
+	}
+	if (priv->trace_writer) priv->trace_writer->press(x, y, state);
+	press(self, x, y, state);
+}
+
+static void drag(PlatonEditorWidget* self, double x, double y) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
 	const double vadjustment = gtk_adjustment_get_value(priv->vadjustment);
+	const std::size_t row = std::max((y + vadjustment - priv->vertical_padding) / priv->line_height, 0.0);
+	std::size_t line, offset;
+	if (priv->line_index->row_to_line(row, line, offset)) {
+		Layout layout = priv->layout_cache->get_layout(gtk_widget_get_pango_context(GTK_WIDGET(self)), priv->font_description, priv->editor->get_theme(), priv->editor->render(line), priv->wrap_width);
+		const std::size_t column = layout.x_to_index(x - priv->gutter_width, offset);
+		priv->editor->extend_selection(column, line);
+		priv->journal->record(JournalOp::EXTEND_SELECTION, column, line);
+		place_cursor(self, JournalOp::EXTEND_SELECTION, line);
+		gtk_widget_queue_draw(GTK_WIDGET(self));
+		start_blinking(self);
+	}
+}
+
+static void handle_drag_update(GtkGestureDrag* drag_gesture, gdouble offset_x, gdouble offset_y, gpointer user_data) {
+	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
 	double start_x, start_y;
 	gtk_gesture_drag_get_start_point(drag_gesture, &start_x, &start_y);
 	const gdouble x = start_x + offset_x;
 	const gdouble y = start_y + offset_y;
-	const std::size_t line = std::max((y + vadjustment - priv->vertical_padding) / priv->line_height, 0.0);
-	if (line < priv->editor->get_total_lines()) {
-		Layout layout = priv->layout_cache->get_layout(gtk_widget_get_pango_context(GTK_WIDGET(self)), priv->font_description, priv->editor->get_theme(), priv->editor->render(line));
-		const std::size_t column = layout.x_to_index(x - priv->gutter_width);
-		priv->editor->extend_selection(column, line);
-		gtk_widget_queue_draw(GTK_WIDGET(self));
-		start_blinking(self);
+	if (priv->load_cancellable) {
+		return;
 	}
+	if (priv->trace_writer) priv->trace_writer->drag(x, y);
+	drag(self, x, y);
 }
 
 static void platon_editor_widget_insert_newline(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const EditScope scope = begin_edit(priv, JournalOp::INSERT_NEWLINE);
 	priv->editor->insert_newline();
-	update(self);
+	priv->journal->record(JournalOp::INSERT_NEWLINE);
+	end_edit(self, scope);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_delete_backward(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const EditScope scope = begin_edit(priv, JournalOp::DELETE_BACKWARD);
 	priv->editor->delete_backward();
-	update(self);
+	priv->journal->record(JournalOp::DELETE_BACKWARD);
+	end_edit(self, scope);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_delete_forward(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const EditScope scope = begin_edit(priv, JournalOp::DELETE_FORWARD);
 	priv->editor->delete_forward();
-	update(self);
+	priv->journal->record(JournalOp::DELETE_FORWARD);
+	end_edit(self, scope);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_left(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_left(extend_selection);
+	priv->journal->record(JournalOp::MOVE_LEFT, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_right(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_right(extend_selection);
+	priv->journal->record(JournalOp::MOVE_RIGHT, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_up(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_up(extend_selection);
+	priv->journal->record(JournalOp::MOVE_UP, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_down(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_down(extend_selection);
+	priv->journal->record(JournalOp::MOVE_DOWN, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_to_beginning_of_line(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_to_beginning_of_line(extend_selection);
+	priv->journal->record(JournalOp::MOVE_TO_BEGINNING_OF_LINE, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
 
 static void platon_editor_widget_move_to_end_of_line(PlatonEditorWidget* self, gboolean extend_selection) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const std::vector<LineRange> ranges = begin_move(priv, extend_selection);
 	priv->editor->move_to_end_of_line(extend_selection);
+	priv->journal->record(JournalOp::MOVE_TO_END_OF_LINE, extend_selection);
+	end_move(self, ranges, extend_selection);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
@@ -558,6 +1826,16 @@ static void platon_editor_widget_move_to_end_of_line(PlatonEditorWidget* self, g
 static void platon_editor_widget_select_all(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
 	priv->editor->select_all();
+	priv->journal->record(JournalOp::SELECT_ALL);
+	// the cursor ends up at one end of the document and the selection reaches the other end
+	const std::size_t last_line = priv->editor->get_total_lines() - 1;
+	priv->cursors->clear();
+	for (std::size_t line: find_cursor_lines(priv, {{0, 0}, {last_line, last_line}})) {
+		priv->cursors->push_back({line, line == last_line ? 0 : last_line});
+	}
+	reveal_cursors(priv);
+	update(self);
+	tag_input(priv);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
@@ -574,8 +1852,21 @@ static void platon_editor_widget_copy(PlatonEditorWidget* self) {
 static void platon_editor_widget_cut(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
 	GtkClipboard* clipboard = gtk_widget_get_clipboard(GTK_WIDGET(self), GDK_SELECTION_CLIPBOARD);
+	const EditScope scope = begin_edit(priv, JournalOp::CUT);
 	gtk_clipboard_set_text(clipboard, priv->editor->cut().c_str(), -1);
-	update(self);
+	priv->journal->record(JournalOp::CUT);
+	end_edit(self, scope);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+	start_blinking(self);
+}
+
+static void paste_text(PlatonEditorWidget* self, const gchar* text) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->trace_writer) priv->trace_writer->paste(text);
+	const EditScope scope = begin_edit(priv, JournalOp::PASTE, text);
+	priv->editor->paste(text);
+	priv->journal->record(JournalOp::PASTE, text);
+	end_edit(self, scope);
 	gtk_widget_queue_draw(GTK_WIDGET(self));
 	start_blinking(self);
 }
@@ -583,29 +1874,51 @@ static void platon_editor_widget_cut(PlatonEditorWidget* self) {
 static void platon_editor_widget_paste(PlatonEditorWidget* self) {
 	GtkClipboard* clipboard = gtk_widget_get_clipboard(GTK_WIDGET(self), GDK_SELECTION_CLIPBOARD);
 	gtk_clipboard_request_text(clipboard, [](GtkClipboard* clipboard, const gchar* text, gpointer user_data) {
-		PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
-		PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
-		priv->editor->paste(text);
-		update(self);
-		gtk_widget_queue_draw(GTK_WIDGET(self));
-		start_blinking(self);
+		if (text) {
+			paste_text(PLATON_EDITOR_WIDGET(user_data), text);
+		}
 	}, self);
 }
 
+static void platon_editor_widget_dispose(GObject* object) {
+	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(object);
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->load_cancellable) {
+		g_cancellable_cancel(priv->load_cancellable);
+		g_clear_object(&priv->load_cancellable);
+	}
+	G_OBJECT_CLASS(platon_editor_widget_parent_class)->dispose(object);
+}
+
 static void platon_editor_widget_finalize(GObject* object) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(object);
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->trace_replay) {
+		if (priv->trace_replay->source_id) g_source_remove(priv->trace_replay->source_id);
+		g_object_unref(priv->trace_replay->task);
+		delete priv->trace_replay;
+	}
+	delete priv->trace_writer;
+	delete priv->latency_histogram;
+	delete priv->input_times;
+	delete priv->pending_latencies;
 	g_object_unref(priv->drag_gesture);
 	g_object_unref(priv->multipress_gesture);
 	g_object_unref(priv->im_context);
 	pango_font_description_free(priv->font_description);
 	if (priv->file) g_object_unref(priv->file);
+	delete priv->folds;
+	delete priv->cursors;
+	delete priv->line_index;
+	delete priv->row_cache;
 	delete priv->layout_cache;
+	delete priv->journal;
 	delete priv->editor;
 	G_OBJECT_CLASS(platon_editor_widget_parent_class)->finalize(object);
 }
 
 static void platon_editor_widget_class_init(PlatonEditorWidgetClass* klass) {
+	G_OBJECT_CLASS(klass)->dispose = platon_editor_widget_dispose;
 	G_OBJECT_CLASS(klass)->finalize = platon_editor_widget_finalize;
 	G_OBJECT_CLASS(klass)->get_property = platon_editor_widget_get_property;
 	G_OBJECT_CLASS(klass)->set_property = platon_editor_widget_set_property;
@@ -613,6 +1926,7 @@ static void platon_editor_widget_class_init(PlatonEditorWidgetClass* klass) {
 	g_object_class_override_property(G_OBJECT_CLASS(klass), PROP_VADJUSTMENT, "vadjustment");
 	g_object_class_override_property(G_OBJECT_CLASS(klass), PROP_HSCROLL_POLICY, "hscroll-policy");
 	g_object_class_override_property(G_OBJECT_CLASS(klass), PROP_VSCROLL_POLICY, "vscroll-policy");
+	g_object_class_install_property(G_OBJECT_CLASS(klass), PROP_WRAP, g_param_spec_boolean("wrap", "Wrap", "Whether long lines are wrapped", FALSE, (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 	GTK_WIDGET_CLASS(klass)->realize = platon_editor_widget_realize;
 	GTK_WIDGET_CLASS(klass)->unrealize = platon_editor_widget_unrealize;
 	GTK_WIDGET_CLASS(klass)->size_allocate = platon_editor_widget_size_allocate;
@@ -696,48 +2010,543 @@ static void platon_editor_widget_init(PlatonEditorWidget* self) {
 	priv->drag_gesture = gtk_gesture_drag_new(GTK_WIDGET(self));
 	g_signal_connect_object(priv->drag_gesture, "drag-update", G_CALLBACK(handle_drag_update), self, G_CONNECT_DEFAULT);
 	priv->layout_cache = new LayoutCache();
+	priv->row_cache = new RowCache();
+	priv->line_index = new LineIndex();
+	priv->folds = new std::map<std::size_t, std::size_t>();
+	priv->cursors = new std::vector<TrackedCursor>();
+	priv->input_times = new std::vector<gint64>();
+	priv->key_time = 0;
+	priv->pending_latencies = new std::vector<PendingLatency>();
+	priv->latency_histogram = new Histogram();
 	gtk_widget_set_can_focus(GTK_WIDGET(self), TRUE);
 	gtk_widget_add_events(GTK_WIDGET(self), GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
 }
 
-PlatonEditorWidget* platon_editor_widget_new(GFile* file) {
+namespace {
+
+struct LoadChunk {
+	PlatonEditorWidget* self;
+	std::string text;
+	bool done;
+	// set on the last chunk if invalid bytes were replaced in any chunk
+	bool lossy;
+	GError* error;
+};
+
+struct LoadData {
+	GFile* file;
+	Compression compression;
+};
+
+}
+
+static void start_replay(PlatonEditorWidget* self);
+
+static gboolean append_chunk(gpointer user_data) {
+	LoadChunk* chunk = (LoadChunk*)user_data;
+	PlatonEditorWidget* self = chunk->self;
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (!priv->load_cancellable) {
+		return G_SOURCE_REMOVE;
+	}
+	if (!chunk->text.empty()) {
+		// input is blocked while loading, so the cursor stays at the end of the document
+		priv->editor->paste(chunk->text.c_str());
+		priv->line_index->resize(priv->line_index->get_total_lines(), priv->editor->get_total_lines());
+	}
+	if (chunk->done) {
+		if (chunk->error) {
+			gchar* name = g_file_get_parse_name(priv->file);
+			g_warning("failed to load %s: %s", name, chunk->error->message);
+			g_free(name);
+		}
+		g_clear_object(&priv->load_cancellable);
+		// saving a document whose invalid bytes were replaced, or that was only partly read, would not reproduce the file
+		priv->lossy = chunk->lossy || chunk->error;
+		priv->editor->set_cursor(0, 0);
+		priv->journal->replay(*priv->editor, *priv->cursors);
+		reset_cursors(priv);
+	}
+	update(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+	if (chunk->done && priv->trace_replay) {
+		// a replay that was requested while loading waits for the complete document
+		start_replay(self);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void free_chunk(gpointer data) {
+	LoadChunk* chunk = (LoadChunk*)data;
+	g_object_unref(chunk->self);
+	if (chunk->error) g_error_free(chunk->error);
+	delete chunk;
+}
+
+// chunks are appended in the order they are sent because they are all dispatched at the same priority
+static void send_chunk(PlatonEditorWidget* self, std::string&& text, bool done, bool lossy, GError* error) {
+	LoadChunk* chunk = new LoadChunk{PLATON_EDITOR_WIDGET(g_object_ref(self)), std::move(text), done, lossy, error};
+	g_main_context_invoke_full(NULL, G_PRIORITY_DEFAULT_IDLE, append_chunk, chunk, free_chunk);
+}
+
+// chunks end after the last complete line, or after the last complete character of a very long line
+static std::size_t get_chunk_end(const std::string& buffer) {
+	const std::size_t newline = buffer.rfind('\n');
+	if (newline != std::string::npos) {
+		return newline + 1;
+	}
+	for (std::size_t i = 1; i <= 3 && i <= buffer.size(); ++i) {
+		if ((buffer[buffer.size() - i] & 0xC0) == 0xC0) {
+			return validate_utf8(buffer.data() + buffer.size() - i, i) == i ? buffer.size() : buffer.size() - i;
+		}
+	}
+	return buffer.size();
+}
+
+// decompresses the file on a worker thread; the first chunk is small so that the first screen can be shown early
+static void load_thread(GTask* task, gpointer source_object, gpointer task_data, GCancellable* cancellable) {
+	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(source_object);
+	LoadData* data = (LoadData*)task_data;
+	GError* error = NULL;
+	GFileInputStream* file_input = g_file_read(data->file, cancellable, &error);
+	if (!file_input) {
+		send_chunk(self, std::string(), true, false, error);
+		g_task_return_boolean(task, FALSE);
+		return;
+	}
+	GConverter* decompressor = create_decompressor(data->compression);
+	GInputStream* input = g_converter_input_stream_new(G_INPUT_STREAM(file_input), decompressor);
+	g_object_unref(decompressor);
+	g_object_unref(file_input);
+	std::string buffer;
+	std::size_t chunk_size = LOAD_FIRST_CHUNK_SIZE;
+	bool eof = false;
+	bool lossy = false;
+	while (!eof) {
+		const std::size_t length = buffer.size();
+		buffer.resize(length + chunk_size);
+		gsize read;
+		if (!g_input_stream_read_all(input, &buffer[length], chunk_size, &read, cancellable, &error)) {
+			break;
+		}
+		buffer.resize(length + read);
+		eof = read < chunk_size;
+		const std::size_t end = eof ? buffer.size() : get_chunk_end(buffer);
+		std::string text = buffer.substr(0, end);
+		buffer.erase(0, end);
+		if (sanitize_utf8(text)) {
+			lossy = true;
+		}
+		if (!text.empty()) {
+			send_chunk(self, std::move(text), false, false, NULL);
+		}
+		chunk_size = LOAD_CHUNK_SIZE;
+	}
+	g_object_unref(input);
+	const bool result = error == NULL;
+	send_chunk(self, std::string(), true, lossy, error);
+	g_task_return_boolean(task, result);
+}
+
+static void free_load_data(gpointer data) {
+	LoadData* load_data = (LoadData*)data;
+	g_object_unref(load_data->file);
+	delete load_data;
+}
+
+static void start_loading(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	priv->load_cancellable = g_cancellable_new();
+	GTask* task = g_task_new(self, priv->load_cancellable, NULL, NULL);
+	g_task_set_task_data(task, new LoadData{G_FILE(g_object_ref(priv->file)), priv->compression}, free_load_data);
+	g_task_run_in_thread(task, load_thread);
+	g_object_unref(task);
+}
+
+PlatonEditorWidget* platon_editor_widget_new(GFile* file, gboolean journal) {
 	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(g_object_new(PLATON_TYPE_EDITOR_WIDGET, NULL));
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	bool stream = false;
 	if (file) {
 		priv->file = file;
 		g_object_ref(priv->file);
 		gchar* path = g_file_get_path(file);
-		priv->editor = new Editor(path);
+		priv->journal = new Journal(journal ? path : NULL);
+		// after a crash, a compacted journal is replayed on top of its snapshot instead of the saved file
+		const std::string snapshot_path = priv->journal->get_snapshot_path();
+		priv->compression = detect_compression(path);
+		if (priv->compression != Compression::NONE) {
+			priv->encoding = Encoding::UTF_8;
+			priv->bom = false;
+			priv->lossy = false;
+			if (!snapshot_path.empty()) {
+				priv->editor = new Editor(snapshot_path.c_str());
+				priv->journal->replay(*priv->editor, *priv->cursors);
+			}
+			else {
+				// the document streams in after the widget is created and the journal is replayed once it is complete;
+				// the core can only be given a file name by opening that file, so it treats the document as untitled and doesn't choose a language by its name
+				priv->editor = new Editor();
+				stream = true;
+			}
+		}
+		else {
+			std::string decoded_path;
+			const bool decoded = decode_file(path, priv->encoding, priv->bom, priv->lossy, decoded_path) && !decoded_path.empty();
+			if (!snapshot_path.empty()) {
+				priv->editor = new Editor(snapshot_path.c_str());
+			}
+			else if (decoded) {
+				priv->editor = new Editor(decoded_path.c_str());
+			}
+			else {
+				priv->editor = new Editor(path);
+			}
+			if (decoded) {
+				g_unlink(decoded_path.c_str());
+			}
+			priv->journal->replay(*priv->editor, *priv->cursors);
+		}
 		g_free(path);
 	}
 	else {
 		priv->editor = new Editor();
+		priv->journal = new Journal(NULL);
+		priv->encoding = Encoding::UTF_8;
+		priv->bom = false;
+		priv->lossy = false;
+		priv->compression = Compression::NONE;
 	}
 	priv->gutter_width = std::round(priv->char_width * count_digits(priv->editor->get_total_lines()) + priv->font_size * (HORIZONTAL_PADDING * 2.0));
+	priv->line_index->reset(priv->editor->get_total_lines());
+	priv->first_visible_line = 0;
+	// a replayed journal may have left the cursors anywhere
+	reset_cursors(priv);
+	priv->wrap = false;
+	priv->wrap_width = -1.0;
 	priv->draw_cursors = false;
 	priv->blink_source_id = 0;
+	if (stream) {
+		start_loading(self);
+	}
 	return self;
 }
 
+// documents that were not plain utf-8 or were compressed are saved to a temporary file and transcoded or compressed from there
+static bool save_document(PlatonEditorWidget* self, const char* path) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->encoding == Encoding::UTF_8 && !priv->bom && priv->compression == Compression::NONE) {
+		priv->editor->save(path);
+		return true;
+	}
+	GError* error = NULL;
+	gchar* decoded_path;
+	const int fd = g_file_open_tmp(("platon-XXXXXX" + get_extension(path)).c_str(), &decoded_path, &error);
+	if (fd < 0) {
+		// saving the document as plain utf-8 instead would silently change the file's encoding
+		g_warning("failed to save %s: %s", path, error->message);
+		g_error_free(error);
+		return false;
+	}
+	g_close(fd, NULL);
+	priv->editor->save(decoded_path);
+	bool result;
+	if (priv->compression != Compression::NONE) {
+		result = compress_file(decoded_path, path, priv->compression);
+	}
+	else {
+		result = encode_file(decoded_path, path, priv->encoding, priv->bom);
+	}
+	g_unlink(decoded_path);
+	g_free(decoded_path);
+	return result;
+}
+
+// the journal is only reset once the document has been saved, otherwise it is still needed to recover the changes
 gboolean platon_editor_widget_save(PlatonEditorWidget* self) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
-	if (!priv->file) {
+	if (!priv->file || priv->load_cancellable) {
+		return FALSE;
+	}
+	if (priv->lossy) {
+		gchar* name = g_file_get_parse_name(priv->file);
+		g_warning("not saving %s because invalid bytes were replaced when it was opened; save it under a new name to keep the replacements", name);
+		g_free(name);
 		return FALSE;
 	}
 	gchar* path = g_file_get_path(priv->file);
-	priv->editor->save(path);
+	const bool saved = save_document(self, path);
+	if (saved) {
+		priv->journal->reset(path);
+	}
 	g_free(path);
-	return TRUE;
+	return saved;
 }
 
 void platon_editor_widget_save_as(PlatonEditorWidget* self, GFile* file) {
 	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->load_cancellable) {
+		return;
+	}
+	gchar* path = g_file_get_path(file);
 	if (file != priv->file) {
 		if (priv->file) g_object_unref(priv->file);
 		priv->file = file;
 		g_object_ref(priv->file);
+		// saving under a new name compresses according to the extension
+		priv->compression = get_compression_for_path(path);
+	}
+	if (save_document(self, path)) {
+		// the file now holds exactly the text of the editor
+		priv->lossy = false;
+		priv->journal->reset(path);
 	}
-	gchar* path = g_file_get_path(priv->file);
-	priv->editor->save(path);
 	g_free(path);
 }
+
+static void record_signal(PlatonEditorWidget* self, gpointer user_data) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	priv->trace_writer->signal((const char*)user_data);
+}
+
+static void record_signal_with_argument(PlatonEditorWidget* self, gboolean argument, gpointer user_data) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	priv->trace_writer->signal((const char*)user_data, argument);
+}
+
+// the operations of a trace are not journaled; they are replayed from the trace itself and a journal would apply them a second time when the document is opened again
+static void stop_journaling(PlatonEditorWidgetPrivate* priv) {
+	delete priv->journal;
+	priv->journal = new Journal(NULL);
+}
+
+gboolean platon_editor_widget_record_trace(PlatonEditorWidget* self, const gchar* path) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	if (priv->trace_writer) {
+		return FALSE;
+	}
+	TraceWriter* trace_writer = new TraceWriter(path);
+	if (!trace_writer->is_open()) {
+		delete trace_writer;
+		return FALSE;
+	}
+	priv->trace_writer = trace_writer;
+	stop_journaling(priv);
+	record_scrolling(self);
+	// pasted text is recorded once the clipboard has delivered it
+	guint n_ids;
+	guint* ids = g_signal_list_ids(PLATON_TYPE_EDITOR_WIDGET, &n_ids);
+	for (guint i = 0; i < n_ids; ++i) {
+		GSignalQuery query;
+		g_signal_query(ids[i], &query);
+		if (!(query.signal_flags & G_SIGNAL_ACTION) || strcmp(query.signal_name, "paste") == 0) {
+			continue;
+		}
+		if (query.n_params == 0) {
+			g_signal_connect(self, query.signal_name, G_CALLBACK(record_signal), (gpointer)query.signal_name);
+		}
+		else if (query.n_params == 1 && query.param_types[0] == G_TYPE_BOOLEAN) {
+			g_signal_connect(self, query.signal_name, G_CALLBACK(record_signal_with_argument), (gpointer)query.signal_name);
+		}
+	}
+	g_free(ids);
+	return TRUE;
+}
+
+static void dispatch_trace_event(PlatonEditorWidget* self, const TraceEvent& event) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	switch (event.type) {
+	case TraceEvent::COMMIT:
+		handle_commit(priv->im_context, (gchar*)event.text.c_str(), self);
+		break;
+	case TraceEvent::PASTE:
+		paste_text(self, event.text.c_str());
+		break;
+	case TraceEvent::SIGNAL:
+		if (!g_signal_lookup(event.text.c_str(), PLATON_TYPE_EDITOR_WIDGET)) {
+			g_warning("unknown signal in trace: %s", event.text.c_str());
+		}
+		else if (event.has_argument) {
+			g_signal_emit_by_name(self, event.text.c_str(), (gboolean)event.argument);
+		}
+		else {
+			g_signal_emit_by_name(self, event.text.c_str());
+		}
+		break;
+	case TraceEvent::PRESS:
+		press(self, event.x, event.y, (GdkModifierType)event.state);
+		break;
+	case TraceEvent::DRAG:
+		drag(self, event.x, event.y);
+		break;
+	case TraceEvent::SCROLL:
+		gtk_adjustment_set_value(priv->vadjustment, event.y);
+		break;
+	}
+}
+
+static void schedule_trace_event(PlatonEditorWidget* self);
+
+static gboolean replay_callback(gpointer user_data) {
+	PlatonEditorWidget* self = PLATON_EDITOR_WIDGET(user_data);
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	TraceReplay* replay = priv->trace_replay;
+	replay->source_id = 0;
+	const TraceEvent& event = replay->events[replay->next_event];
+	++replay->next_event;
+	const gint64 start_time = g_get_monotonic_time();
+	dispatch_trace_event(self, event);
+	replay->event_histograms[event.get_name()].add(g_get_monotonic_time() - start_time);
+	schedule_trace_event(self);
+	return G_SOURCE_REMOVE;
+}
+
+static void schedule_trace_event(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	TraceReplay* replay = priv->trace_replay;
+	if (replay->next_event < replay->events.size()) {
+		if (replay->max_speed) {
+			// an idle source lets the pending frames be drawn between events
+			replay->source_id = g_idle_add(replay_callback, self);
+		}
+		else {
+			const gint64 delay = replay->start_time + replay->events[replay->next_event].time - g_get_monotonic_time();
+			replay->source_id = g_timeout_add(std::max<gint64>(delay, 0) / 1000, replay_callback, self);
+		}
+		return;
+	}
+	std::string report;
+	for (const auto& entry: replay->event_histograms) {
+		entry.second.append_report(report, entry.first.c_str());
+	}
+	replay->frame_histogram.append_report(report, "frame");
+	GTask* task = replay->task;
+	delete replay;
+	priv->trace_replay = nullptr;
+	g_task_return_pointer(task, g_strdup(report.c_str()), g_free);
+	g_object_unref(task);
+}
+
+// the recorded coordinates are only meaningful once the widget has been allocated, and the recorded input only applies to the complete document
+static void start_replay(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	TraceReplay* replay = priv->trace_replay;
+	if (!gtk_widget_get_mapped(GTK_WIDGET(self)) || priv->load_cancellable) {
+		return;
+	}
+	if (replay->map_handler_id) {
+		g_signal_handler_disconnect(self, replay->map_handler_id);
+		replay->map_handler_id = 0;
+	}
+	replay->start_time = g_get_monotonic_time();
+	schedule_trace_event(self);
+}
+
+void platon_editor_widget_replay_trace(PlatonEditorWidget* self, const gchar* path, gboolean max_speed, GAsyncReadyCallback callback, gpointer user_data) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	GTask* task = g_task_new(self, NULL, callback, user_data);
+	if (priv->trace_replay) {
+		g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_PENDING, "a trace is already being replayed");
+		g_object_unref(task);
+		return;
+	}
+	std::vector<TraceEvent> events;
+	if (!read_trace(path, events)) {
+		g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "failed to read trace %s", path);
+		g_object_unref(task);
+		return;
+	}
+	TraceReplay* replay = new TraceReplay();
+	replay->events = std::move(events);
+	replay->next_event = 0;
+	replay->max_speed = max_speed;
+	replay->source_id = 0;
+	replay->map_handler_id = 0;
+	replay->task = task;
+	priv->trace_replay = replay;
+	stop_journaling(priv);
+	replay->map_handler_id = g_signal_connect(self, "map", G_CALLBACK(start_replay), NULL);
+	start_replay(self);
+}
+
+gchar* platon_editor_widget_replay_trace_finish(PlatonEditorWidget* self, GAsyncResult* result, GError** error) {
+	g_return_val_if_fail(g_task_is_valid(result, self), NULL);
+	return (gchar*)g_task_propagate_pointer(G_TASK(result), error);
+}
+
+gchar* platon_editor_widget_get_latency_report(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	std::string report;
+	priv->latency_histogram->append_report(report, "input latency");
+	return g_strdup(report.c_str());
+}
+
+static bool is_hidden(PlatonEditorWidget* self) {
+	if (!gtk_widget_get_mapped(GTK_WIDGET(self))) {
+		return true;
+	}
+	GdkWindow* window = gtk_widget_get_window(gtk_widget_get_toplevel(GTK_WIDGET(self)));
+	return !window || (gdk_window_get_state(window) & GDK_WINDOW_STATE_ICONIFIED);
+}
+
+// trims in steps: caches of hidden editors first, then the row pixels of all editors, then everything that is rebuilt on the next frame
+void platon_editor_widget_trim_memory(PlatonEditorWidget* self, GMemoryMonitorWarningLevel level) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	const bool hidden = is_hidden(self);
+	if (hidden || level >= G_MEMORY_MONITOR_WARNING_LEVEL_MEDIUM) {
+		priv->row_cache->clear();
+		priv->journal->flush();
+	}
+	if (hidden || level >= G_MEMORY_MONITOR_WARNING_LEVEL_CRITICAL) {
+		priv->layout_cache->clear();
+		priv->input_times->shrink_to_fit();
+		priv->pending_latencies->shrink_to_fit();
+	}
+}
+
+static void append_memory_usage(std::string& report, const char* name, std::size_t bytes) {
+	gchar* line = g_strdup_printf("  %s: %zu bytes\n", name, bytes);
+	report.append(line);
+	g_free(line);
+}
+
+static void append_memory_usage(std::string& report, const char* name, std::size_t entries, std::size_t bytes) {
+	gchar* line = g_strdup_printf("  %s: %zu entries, %zu bytes\n", name, entries, bytes);
+	report.append(line);
+	g_free(line);
+}
+
+gchar* platon_editor_widget_get_memory_report(PlatonEditorWidget* self) {
+	PlatonEditorWidgetPrivate* priv = (PlatonEditorWidgetPrivate*)platon_editor_widget_get_instance_private(self);
+	std::string report;
+	gchar* name = priv->file ? g_file_get_parse_name(priv->file) : g_strdup("untitled");
+	gchar* line = g_strdup_printf("%s (%s)\n", name, is_hidden(self) ? "hidden" : "visible");
+	report.append(line);
+	g_free(line);
+	g_free(name);
+	const std::size_t layout_cache_bytes = priv->layout_cache->get_memory_usage();
+	const std::size_t row_cache_bytes = priv->row_cache->get_memory_usage();
+	const std::size_t line_index_bytes = priv->line_index->get_memory_usage();
+	const std::size_t folds_bytes = priv->folds->size() * (sizeof(std::pair<const std::size_t, std::size_t>) + MAP_NODE_OVERHEAD);
+	const std::size_t journal_bytes = priv->journal->get_pending_bytes();
+	std::size_t trace_bytes = sizeof(Histogram) + priv->input_times->capacity() * sizeof(gint64) + priv->pending_latencies->capacity() * sizeof(PendingLatency);
+	for (const PendingLatency& pending_latency: *priv->pending_latencies) {
+		trace_bytes += pending_latency.input_times.capacity() * sizeof(gint64);
+	}
+	if (priv->trace_replay) {
+		trace_bytes += sizeof(TraceReplay) + priv->trace_replay->events.capacity() * sizeof(TraceEvent) + priv->trace_replay->event_histograms.size() * (sizeof(Histogram) + MAP_NODE_OVERHEAD);
+		for (const TraceEvent& event: priv->trace_replay->events) {
+			trace_bytes += event.text.capacity();
+		}
+	}
+	append_memory_usage(report, "layout cache", priv->layout_cache->get_size(), layout_cache_bytes);
+	append_memory_usage(report, "row cache", priv->row_cache->get_size(), row_cache_bytes);
+	append_memory_usage(report, "line index", priv->line_index->get_node_count(), line_index_bytes);
+	append_memory_usage(report, "folds", priv->folds->size(), folds_bytes);
+	append_memory_usage(report, "journal", journal_bytes);
+	append_memory_usage(report, "tracing", trace_bytes);
+	line = g_strdup_printf("  total: %zu bytes (document and highlighter state are held by the editor core and not included)\n", layout_cache_bytes + row_cache_bytes + line_index_bytes + folds_bytes + journal_bytes + trace_bytes);
+	report.append(line);
+	g_free(line);
+	return g_strdup(report.c_str());
+}
@@ -24,9 +24,17 @@ struct _PlatonEditorWidgetClass {
 	void (*paste)(PlatonEditorWidget* self);
 };
 
-PlatonEditorWidget* platon_editor_widget_new(GFile* file);
+PlatonEditorWidget* platon_editor_widget_new(GFile* file, gboolean journal);
 
 gboolean platon_editor_widget_save(PlatonEditorWidget* self);
 void platon_editor_widget_save_as(PlatonEditorWidget* self, GFile* file);
 
+gboolean platon_editor_widget_record_trace(PlatonEditorWidget* self, const gchar* path);
+void platon_editor_widget_replay_trace(PlatonEditorWidget* self, const gchar* path, gboolean max_speed, GAsyncReadyCallback callback, gpointer user_data);
+gchar* platon_editor_widget_replay_trace_finish(PlatonEditorWidget* self, GAsyncResult* result, GError** error);
+gchar* platon_editor_widget_get_latency_report(PlatonEditorWidget* self);
+
+void platon_editor_widget_trim_memory(PlatonEditorWidget* self, GMemoryMonitorWarningLevel level);
+gchar* platon_editor_widget_get_memory_report(PlatonEditorWidget* self);
+
 G_END_DECLS
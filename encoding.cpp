@@ -0,0 +1,426 @@
+#include "encoding.hpp"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ENCODING_CHUNK_SIZE (1 << 20)
+#define REPLACEMENT_CHARACTER "\xEF\xBF\xBD"
+
+namespace {
+
+struct Utf8Statistics {
+	std::size_t sequences = 0;
+	std::size_t invalid_bytes = 0;
+};
+
+}
+
+static const char* get_charset(Encoding encoding) {
+	switch (encoding) {
+	case Encoding::UTF_16LE:
+		return "UTF-16LE";
+	case Encoding::UTF_16BE:
+		return "UTF-16BE";
+	case Encoding::ISO_8859_1:
+		return "ISO-8859-1";
+	default:
+		return "UTF-8";
+	}
+}
+
+static const char* get_bom(Encoding encoding) {
+	switch (encoding) {
+	case Encoding::UTF_16LE:
+		return "\xFF\xFE";
+	case Encoding::UTF_16BE:
+		return "\xFE\xFF";
+	case Encoding::UTF_8:
+		return "\xEF\xBB\xBF";
+	default:
+		return "";
+	}
+}
+
+// skips ascii bytes 32 or 8 bytes at a time, depending on the availability of sse2
+static const unsigned char* skip_ascii(const unsigned char* pointer, const unsigned char* end) {
+#ifdef __SSE2__
+	while (end - pointer >= 32) {
+		const __m128i a = _mm_loadu_si128((const __m128i*)pointer);
+		const __m128i b = _mm_loadu_si128((const __m128i*)(pointer + 16));
+		if (_mm_movemask_epi8(_mm_or_si128(a, b))) {
+			break;
+		}
+		pointer += 32;
+	}
+	while (end - pointer >= 16) {
+		const int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)pointer));
+		if (mask) {
+			return pointer + __builtin_ctz(mask);
+		}
+		pointer += 16;
+	}
+#else
+	while (end - pointer >= 8) {
+		std::uint64_t word;
+		std::memcpy(&word, pointer, 8);
+		if (word & UINT64_C(0x8080808080808080)) {
+			break;
+		}
+		pointer += 8;
+	}
+#endif
+	while (pointer < end && *pointer < 0x80) {
+		++pointer;
+	}
+	return pointer;
+}
+
+// returns the length of the sequence starting at pointer, 0 if it is truncated or -1 if it is invalid
+static int get_sequence_length(const unsigned char* pointer, std::size_t remaining) {
+	const unsigned char c = pointer[0];
+	int length;
+	unsigned char min = 0x80;
+	unsigned char max = 0xBF;
+	if (c < 0x80) {
+		return 1;
+	}
+	else if (c >= 0xC2 && c <= 0xDF) {
+		length = 2;
+	}
+	else if (c == 0xE0) {
+		length = 3;
+		min = 0xA0;
+	}
+	else if (c == 0xED) {
+		length = 3;
+		max = 0x9F;
+	}
+	else if (c >= 0xE1 && c <= 0xEF) {
+		length = 3;
+	}
+	else if (c == 0xF0) {
+		length = 4;
+		min = 0x90;
+	}
+	else if (c == 0xF4) {
+		length = 4;
+		max = 0x8F;
+	}
+	else if (c >= 0xF1 && c <= 0xF3) {
+		length = 4;
+	}
+	else {
+		return -1;
+	}
+	for (int i = 1; i < length; ++i) {
+		if ((std::size_t)i >= remaining) {
+			return 0;
+		}
+		if (pointer[i] < min || pointer[i] > max) {
+			return -1;
+		}
+		min = 0x80;
+		max = 0xBF;
+	}
+	return length;
+}
+
+static const unsigned char* validate(const unsigned char* pointer, const unsigned char* end, std::size_t& sequences) {
+	while (true) {
+		pointer = skip_ascii(pointer, end);
+		if (pointer == end) {
+			return pointer;
+		}
+		const int length = get_sequence_length(pointer, end - pointer);
+		if (length <= 0) {
+			return pointer;
+		}
+		pointer += length;
+		++sequences;
+	}
+}
+
+std::size_t validate_utf8(const char* data, std::size_t length) {
+	std::size_t sequences = 0;
+	const unsigned char* begin = (const unsigned char*)data;
+	return validate(begin, begin + length, sequences) - begin;
+}
+
+bool sanitize_utf8(std::string& text) {
+	bool replaced = false;
+	std::size_t position = 0;
+	while (position < text.size()) {
+		position += validate_utf8(text.data() + position, text.size() - position);
+		if (position < text.size()) {
+			text[position] = '?';
+			++position;
+			replaced = true;
+		}
+	}
+	for (char& c: text) {
+		if (c == '\0') {
+			c = '?';
+			replaced = true;
+		}
+	}
+	return replaced;
+}
+
+// scans a chunk and returns the number of bytes consumed; unless eof is set, a truncated sequence at the end is left for the next chunk
+static std::size_t scan_utf8(const char* data, std::size_t length, bool eof, Utf8Statistics& statistics, std::string* output) {
+	const unsigned char* begin = (const unsigned char*)data;
+	const unsigned char* end = begin + length;
+	const unsigned char* pointer = begin;
+	while (true) {
+		const unsigned char* valid_end = validate(pointer, end, statistics.sequences);
+		if (output) {
+			output->append((const char*)pointer, valid_end - pointer);
+		}
+		pointer = valid_end;
+		if (pointer == end || (!eof && get_sequence_length(pointer, end - pointer) == 0)) {
+			break;
+		}
+		++statistics.invalid_bytes;
+		if (output) {
+			output->append(REPLACEMENT_CHARACTER);
+		}
+		++pointer;
+	}
+	return pointer - begin;
+}
+
+// streams the rest of input through scan_utf8, writing the result to output unless it is NULL
+static bool scan_stream(GInputStream* input, Utf8Statistics& statistics, GOutputStream* output, GError** error) {
+	std::string buffer(ENCODING_CHUNK_SIZE, '\0');
+	std::string decoded;
+	std::size_t carry = 0;
+	while (true) {
+		gsize length;
+		if (!g_input_stream_read_all(input, &buffer[carry], buffer.size() - carry, &length, NULL, error)) {
+			return false;
+		}
+		const bool eof = length < buffer.size() - carry;
+		length += carry;
+		const std::size_t consumed = scan_utf8(buffer.data(), length, eof, statistics, output ? &decoded : nullptr);
+		if (output) {
+			if (!g_output_stream_write_all(output, decoded.data(), decoded.size(), NULL, NULL, error)) {
+				return false;
+			}
+			decoded.clear();
+		}
+		if (eof) {
+			return true;
+		}
+		carry = length - consumed;
+		std::memmove(&buffer[0], buffer.data() + consumed, carry);
+	}
+}
+
+// text that cannot be converted fails the conversion, unless lossy is given; then it is replaced and lossy is set
+static bool convert_stream(GInputStream* input, GOutputStream* output, const char* to_charset, const char* from_charset, bool* lossy, GError** error) {
+	GCharsetConverter* converter = g_charset_converter_new(to_charset, from_charset, error);
+	if (!converter) {
+		return false;
+	}
+	g_charset_converter_set_use_fallback(converter, lossy != NULL);
+	GInputStream* converted = g_converter_input_stream_new(input, G_CONVERTER(converter));
+	const gssize result = g_output_stream_splice(output, converted, G_OUTPUT_STREAM_SPLICE_NONE, NULL, error);
+	if (lossy && g_charset_converter_get_num_fallbacks(converter) > 0) {
+		*lossy = true;
+	}
+	g_object_unref(converted);
+	g_object_unref(converter);
+	return result >= 0;
+}
+
+bool close_output(GOutputStream* output, bool result, GError** error) {
+	if (result) {
+		return g_output_stream_close(output, NULL, error);
+	}
+	// closing with a cancelled cancellable discards the output instead of replacing the original file
+	GCancellable* cancellable = g_cancellable_new();
+	g_cancellable_cancel(cancellable);
+	g_output_stream_close(output, cancellable, NULL);
+	g_object_unref(cancellable);
+	return false;
+}
+
+// utf-16 without a bom is recognized by the nul bytes that make up every other byte of mostly latin text
+static bool detect_utf16(const char* data, std::size_t length, Encoding& encoding) {
+	const std::size_t pairs = length / 2;
+	std::size_t even = 0;
+	std::size_t odd = 0;
+	for (std::size_t i = 0; i < pairs; ++i) {
+		even += data[i * 2] == '\0';
+		odd += data[i * 2 + 1] == '\0';
+	}
+	if (odd * 4 >= pairs && even * 8 < odd) {
+		encoding = Encoding::UTF_16LE;
+		return pairs > 0;
+	}
+	if (even * 4 >= pairs && odd * 8 < even) {
+		encoding = Encoding::UTF_16BE;
+		return pairs > 0;
+	}
+	return false;
+}
+
+static std::size_t detect_encoding(const char* data, std::size_t length, Encoding& encoding, bool& bom) {
+	static const Encoding encodings[] = {Encoding::UTF_8, Encoding::UTF_16LE, Encoding::UTF_16BE};
+	for (Encoding candidate: encodings) {
+		const std::size_t bom_length = std::strlen(get_bom(candidate));
+		if (length >= bom_length && std::memcmp(data, get_bom(candidate), bom_length) == 0) {
+			encoding = candidate;
+			bom = true;
+			return bom_length;
+		}
+	}
+	bom = false;
+	if (!detect_utf16(data, length, encoding)) {
+		encoding = Encoding::UTF_8;
+	}
+	return 0;
+}
+
+std::string get_extension(const char* path) {
+	std::string name = path;
+	name.erase(0, name.find_last_of('/') + 1);
+	for (const char* suffix: {".gz", ".zst"}) {
+		if (g_str_has_suffix(name.c_str(), suffix)) {
+			name.erase(name.size() - strlen(suffix));
+			break;
+		}
+	}
+	const std::size_t dot = name.find_last_of('.');
+	return dot == std::string::npos || dot == 0 ? std::string() : name.substr(dot);
+}
+
+static GOutputStream* create_temporary_file(const std::string& extension, std::string& temporary_path, GError** error) {
+	gchar* name;
+	const int fd = g_file_open_tmp(("platon-XXXXXX" + extension).c_str(), &name, error);
+	if (fd < 0) {
+		return NULL;
+	}
+	g_close(fd, NULL);
+	temporary_path = name;
+	GFile* file = g_file_new_for_path(name);
+	g_free(name);
+	GFileOutputStream* output = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL, error);
+	g_object_unref(file);
+	return G_OUTPUT_STREAM(output);
+}
+
+static bool decode_stream(GInputStream* input, std::size_t bom_length, Encoding& encoding, bool bom, bool& lossy, const std::string& extension, std::string& decoded_path, GError** error) {
+	bool replace = false;
+	if (encoding == Encoding::UTF_8) {
+		Utf8Statistics statistics;
+		if (!scan_stream(input, statistics, NULL, error)) {
+			return false;
+		}
+		if (statistics.invalid_bytes == 0 && !bom) {
+			return true;
+		}
+		// a file with more valid multi-byte sequences than invalid bytes is taken to be utf-8 with stray bytes, anything else is latin-1
+		if (statistics.invalid_bytes > 0 && statistics.sequences < statistics.invalid_bytes) {
+			encoding = Encoding::ISO_8859_1;
+		}
+		else if (statistics.invalid_bytes > 0) {
+			g_warning("replacing %zu invalid bytes", statistics.invalid_bytes);
+			replace = true;
+			lossy = true;
+		}
+		if (!g_seekable_seek(G_SEEKABLE(input), bom_length, G_SEEK_SET, NULL, error)) {
+			return false;
+		}
+	}
+	GOutputStream* output = create_temporary_file(extension, decoded_path, error);
+	if (!output) {
+		return false;
+	}
+	bool result;
+	if (replace) {
+		Utf8Statistics statistics;
+		result = scan_stream(input, statistics, output, error);
+	}
+	else if (encoding == Encoding::UTF_8) {
+		result = g_output_stream_splice(output, input, G_OUTPUT_STREAM_SPLICE_NONE, NULL, error) >= 0;
+	}
+	else {
+		result = convert_stream(input, output, "UTF-8", get_charset(encoding), &lossy, error);
+	}
+	result = close_output(output, result, error);
+	g_object_unref(output);
+	if (!result) {
+		g_unlink(decoded_path.c_str());
+		decoded_path.clear();
+	}
+	return result;
+}
+
+bool decode_file(const char* path, Encoding& encoding, bool& bom, bool& lossy, std::string& decoded_path) {
+	encoding = Encoding::UTF_8;
+	bom = false;
+	lossy = false;
+	decoded_path.clear();
+	GFile* file = g_file_new_for_path(path);
+	GFileInputStream* input = g_file_read(file, NULL, NULL);
+	g_object_unref(file);
+	if (!input) {
+		return false;
+	}
+	GError* error = NULL;
+	std::string sample(ENCODING_CHUNK_SIZE, '\0');
+	gsize length;
+	bool result = g_input_stream_read_all(G_INPUT_STREAM(input), &sample[0], sample.size(), &length, NULL, &error);
+	if (result) {
+		const std::size_t bom_length = detect_encoding(sample.data(), length, encoding, bom);
+		result = g_seekable_seek(G_SEEKABLE(input), bom_length, G_SEEK_SET, NULL, &error) && decode_stream(G_INPUT_STREAM(input), bom_length, encoding, bom, lossy, get_extension(path), decoded_path, &error);
+	}
+	if (!result) {
+		g_warning("failed to decode %s: %s", path, error->message);
+		g_error_free(error);
+		encoding = Encoding::UTF_8;
+		bom = false;
+		lossy = false;
+	}
+	g_object_unref(input);
+	return result;
+}
+
+bool encode_file(const char* decoded_path, const char* path, Encoding encoding, bool bom) {
+	GError* error = NULL;
+	GFile* source = g_file_new_for_path(decoded_path);
+	GFileInputStream* input = g_file_read(source, NULL, &error);
+	g_object_unref(source);
+	GFileOutputStream* output = NULL;
+	if (input) {
+		GFile* file = g_file_new_for_path(path);
+		output = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, &error);
+		g_object_unref(file);
+	}
+	bool result = input && output;
+	if (result && bom) {
+		result = g_output_stream_write_all(G_OUTPUT_STREAM(output), get_bom(encoding), std::strlen(get_bom(encoding)), NULL, NULL, &error);
+	}
+	if (result && encoding == Encoding::UTF_8) {
+		result = g_output_stream_splice(G_OUTPUT_STREAM(output), G_INPUT_STREAM(input), G_OUTPUT_STREAM_SPLICE_NONE, NULL, &error) >= 0;
+	}
+	else if (result) {
+		// a character the encoding cannot represent fails the save instead of being written as an escape
+		result = convert_stream(G_INPUT_STREAM(input), G_OUTPUT_STREAM(output), get_charset(encoding), "UTF-8", NULL, &error);
+	}
+	if (output) {
+		result = close_output(G_OUTPUT_STREAM(output), result, &error);
+	}
+	if (!result) {
+		g_warning("failed to encode %s: %s", path, error->message);
+		g_error_free(error);
+	}
+	if (output) g_object_unref(output);
+	if (input) g_object_unref(input);
+	return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <gio/gio.h>
+#include <string>
+
+enum class Encoding {
+	UTF_8,
+	UTF_16LE,
+	UTF_16BE,
+	ISO_8859_1
+};
+
+// returns the length of the longest prefix of data that consists of complete and valid utf-8 sequences
+std::size_t validate_utf8(const char* data, std::size_t length);
+
+// replaces every byte that is not part of a valid utf-8 sequence, as well as every nul byte, with a question mark so that byte offsets are preserved; returns whether anything was replaced
+bool sanitize_utf8(std::string& text);
+
+// returns the extension of the file name in path, not counting a .gz or .zst suffix; temporary copies of a document keep it so that the core chooses the same language for them
+std::string get_extension(const char* path);
+
+// detects the encoding of the file at path; unless it is utf-8 without a bom, the file is transcoded to a temporary utf-8 file whose path is stored in decoded_path
+// lossy is set if invalid bytes had to be replaced, in which case saving the decoded text would not reproduce them
+bool decode_file(const char* path, Encoding& encoding, bool& bom, bool& lossy, std::string& decoded_path);
+
+// writes the utf-8 file at decoded_path to path in the given encoding
+bool encode_file(const char* decoded_path, const char* path, Encoding encoding, bool bom);
+
+// closes an output stream that replaces a file if everything was written to it, otherwise discards it and leaves the file as it was
+bool close_output(GOutputStream* output, bool result, GError** error);
@@ -0,0 +1,484 @@
+#include "journal.hpp"
+#include "encoding.hpp"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "PLATONJ2"
+#define JOURNAL_FLUSH_INTERVAL 1000
+// once the journal grows past this size it is replaced by a snapshot of the document
+#define JOURNAL_COMPACTION_SIZE (1 << 20)
+#define JOURNAL_HEADER_MAX_SIZE 64
+
+namespace {
+
+enum class WriteKind {
+	APPEND,
+	REPLACE,
+	REMOVE,
+	SYNC
+};
+
+struct Write {
+	WriteKind kind;
+	std::string path;
+	std::string data;
+	Write(WriteKind kind, const std::string& path, std::string&& data = std::string()): kind(kind), path(path), data(std::move(data)) {}
+};
+
+}
+
+static void write_varint(std::string& buffer, guint64 value) {
+	while (value >= 0x80) {
+		buffer.push_back((char)((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back((char)value);
+}
+
+static bool read_varint(const char*& pointer, const char* end, guint64& value) {
+	value = 0;
+	for (int shift = 0; pointer < end && shift < 64; shift += 7) {
+		const unsigned char byte = *pointer++;
+		value |= (guint64)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool read_text(const char*& pointer, const char* end, std::string& text) {
+	guint64 length;
+	if (!read_varint(pointer, end, length) || length > (guint64)(end - pointer)) {
+		return false;
+	}
+	text.assign(pointer, length);
+	pointer += length;
+	return true;
+}
+
+static bool read_header(const char*& pointer, const char* end, guint64& size, guint64& mtime, guint64& snapshot) {
+	const std::size_t magic_length = sizeof(JOURNAL_MAGIC) - 1;
+	if ((std::size_t)(end - pointer) < magic_length || memcmp(pointer, JOURNAL_MAGIC, magic_length) != 0) {
+		return false;
+	}
+	pointer += magic_length;
+	return read_varint(pointer, end, size) && read_varint(pointer, end, mtime) && read_varint(pointer, end, snapshot);
+}
+
+// runs on the writer thread; every write is followed by an fsync so that a flushed group of operations survives a crash
+static void write_func(gpointer data, gpointer user_data) {
+	Write* write = (Write*)data;
+	if (write->kind == WriteKind::REMOVE) {
+		g_unlink(write->path.c_str());
+	}
+	else if (write->kind == WriteKind::SYNC) {
+		const int fd = g_open(write->path.c_str(), O_RDONLY, 0);
+		if (fd >= 0) {
+			g_fsync(fd);
+			g_close(fd, NULL);
+		}
+		else {
+			g_warning("failed to open journal snapshot %s", write->path.c_str());
+		}
+	}
+	else {
+		const int flags = O_WRONLY | O_CREAT | (write->kind == WriteKind::APPEND ? O_APPEND : O_TRUNC);
+		const int fd = g_open(write->path.c_str(), flags, 0600);
+		if (fd >= 0) {
+			const char* pointer = write->data.data();
+			std::size_t remaining = write->data.size();
+			while (remaining > 0) {
+				const ssize_t written = ::write(fd, pointer, remaining);
+				if (written < 0) {
+					g_warning("failed to write journal %s", write->path.c_str());
+					break;
+				}
+				pointer += written;
+				remaining -= written;
+			}
+			g_fsync(fd);
+			g_close(fd, NULL);
+		}
+		else {
+			g_warning("failed to open journal %s", write->path.c_str());
+		}
+	}
+	delete write;
+}
+
+Journal::Journal(const char* document_path): lock_fd(-1), base_size(0), base_mtime(0), snapshot(0), journal_size(0), editor(nullptr), cursors(nullptr), started(false), replace(true), flush_source_id(0) {
+	writer = g_thread_pool_new(write_func, NULL, 1, FALSE, NULL);
+	set_document_path(document_path);
+}
+
+Journal::~Journal() {
+	flush();
+	g_thread_pool_free(writer, FALSE, TRUE);
+	if (lock_fd >= 0) {
+		g_close(lock_fd, NULL);
+	}
+}
+
+void Journal::set_document_path(const char* document_path) {
+	journal_path.clear();
+	if (lock_fd >= 0) {
+		// closing the file releases the lock
+		g_close(lock_fd, NULL);
+		lock_fd = -1;
+	}
+	if (!document_path) {
+		return;
+	}
+	GStatBuf buf;
+	if (g_stat(document_path, &buf) == 0) {
+		base_size = buf.st_size;
+		base_mtime = buf.st_mtime;
+	}
+	else {
+		base_size = 0;
+		base_mtime = 0;
+	}
+	extension = get_extension(document_path);
+	gchar* directory = g_build_filename(g_get_user_cache_dir(), "platon", "journal", NULL);
+	g_mkdir_with_parents(directory, 0700);
+	gchar* name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, document_path, -1);
+	gchar* path = g_build_filename(directory, name, NULL);
+	const std::string lock_path = std::string(path) + ".lock";
+	lock_fd = g_open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lock_fd >= 0 && flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+		journal_path = path;
+	}
+	else {
+		// the document is already journaled by another editor, so changes made here are not recovered
+		g_warning("not journaling %s, it is open in another editor", document_path);
+		if (lock_fd >= 0) {
+			g_close(lock_fd, NULL);
+			lock_fd = -1;
+		}
+	}
+	g_free(path);
+	g_free(name);
+	g_free(directory);
+}
+
+std::string Journal::get_snapshot_path(guint64 snapshot) const {
+	return journal_path + "." + std::to_string(snapshot) + extension;
+}
+
+std::string Journal::get_snapshot_path() const {
+	if (journal_path.empty()) {
+		return std::string();
+	}
+	const int fd = g_open(journal_path.c_str(), O_RDONLY, 0);
+	if (fd < 0) {
+		return std::string();
+	}
+	char header[JOURNAL_HEADER_MAX_SIZE];
+	const ssize_t length = ::read(fd, header, sizeof(header));
+	g_close(fd, NULL);
+	const char* pointer = header;
+	guint64 size, mtime, snapshot;
+	if (length <= 0 || !read_header(pointer, header + length, size, mtime, snapshot) || size != base_size || (gint64)mtime != base_mtime || snapshot == 0) {
+		return std::string();
+	}
+	return get_snapshot_path(snapshot);
+}
+
+bool Journal::replay(Editor& editor, const std::vector<TrackedCursor>& cursors) {
+	if (journal_path.empty()) {
+		return false;
+	}
+	this->editor = &editor;
+	this->cursors = &cursors;
+	gchar* contents;
+	gsize length;
+	if (!g_file_get_contents(journal_path.c_str(), &contents, &length, NULL)) {
+		return false;
+	}
+	const char* pointer = contents;
+	const char* end = contents + length;
+	guint64 size, mtime, snapshot;
+	const bool valid_header = read_header(pointer, end, size, mtime, snapshot);
+	if (!valid_header || size != base_size || (gint64)mtime != base_mtime) {
+		// the journal belongs to a different version of the document
+		g_thread_pool_push(writer, new Write(WriteKind::REMOVE, journal_path), NULL);
+		if (valid_header && snapshot > 0) {
+			g_thread_pool_push(writer, new Write(WriteKind::REMOVE, get_snapshot_path(snapshot)), NULL);
+		}
+		g_free(contents);
+		return false;
+	}
+	// the editor has been opened from the snapshot if there is one
+	this->snapshot = snapshot;
+	const char* valid_end = pointer;
+	std::string text;
+	guint64 column, line;
+	while (pointer < end) {
+		const JournalOp op = (JournalOp)*pointer++;
+		switch (op) {
+		case JournalOp::INSERT_TEXT:
+			if (!read_text(pointer, end, text)) goto done;
+			editor.insert_text(text.c_str());
+			break;
+		case JournalOp::INSERT_NEWLINE:
+			editor.insert_newline();
+			break;
+		case JournalOp::DELETE_BACKWARD:
+			editor.delete_backward();
+			break;
+		case JournalOp::DELETE_FORWARD:
+			editor.delete_forward();
+			break;
+		case JournalOp::MOVE_LEFT:
+			if (pointer == end) goto done;
+			editor.move_left(*pointer++);
+			break;
+		case JournalOp::MOVE_RIGHT:
+			if (pointer == end) goto done;
+			editor.move_right(*pointer++);
+			break;
+		case JournalOp::MOVE_UP:
+			if (pointer == end) goto done;
+			editor.move_up(*pointer++);
+			break;
+		case JournalOp::MOVE_DOWN:
+			if (pointer == end) goto done;
+			editor.move_down(*pointer++);
+			break;
+		case JournalOp::MOVE_TO_BEGINNING_OF_LINE:
+			if (pointer == end) goto done;
+			editor.move_to_beginning_of_line(*pointer++);
+			break;
+		case JournalOp::MOVE_TO_END_OF_LINE:
+			if (pointer == end) goto done;
+			editor.move_to_end_of_line(*pointer++);
+			break;
+		case JournalOp::SELECT_ALL:
+			editor.select_all();
+			break;
+		case JournalOp::CUT:
+			editor.cut();
+			break;
+		case JournalOp::PASTE:
+			if (!read_text(pointer, end, text)) goto done;
+			editor.paste(text.c_str());
+			break;
+		case JournalOp::SET_CURSOR:
+			if (!read_varint(pointer, end, column) || !read_varint(pointer, end, line)) goto done;
+			editor.set_cursor(column, line);
+			break;
+		case JournalOp::TOGGLE_CURSOR:
+			if (!read_varint(pointer, end, column) || !read_varint(pointer, end, line)) goto done;
+			editor.toggle_cursor(column, line);
+			break;
+		case JournalOp::EXTEND_SELECTION:
+			if (!read_varint(pointer, end, column) || !read_varint(pointer, end, line)) goto done;
+			editor.extend_selection(column, line);
+			break;
+		default:
+			goto done;
+		}
+		valid_end = pointer;
+	}
+	done:
+	started = true;
+	journal_size = valid_end - contents;
+	if (valid_end < end) {
+		// drop the torn tail of the last write before appending to the journal again
+		pending.assign(contents, valid_end - contents);
+		replace = true;
+		flush();
+	}
+	else {
+		replace = false;
+	}
+	g_free(contents);
+	return true;
+}
+
+bool Journal::begin_record(JournalOp op) {
+	if (journal_path.empty()) {
+		return false;
+	}
+	if (!started) {
+		append_header(pending);
+		started = true;
+	}
+	pending.push_back((char)op);
+	if (!flush_source_id) {
+		flush_source_id = g_timeout_add(JOURNAL_FLUSH_INTERVAL, flush_callback, this);
+	}
+	return true;
+}
+
+void Journal::record(JournalOp op) {
+	begin_record(op);
+}
+
+void Journal::record(JournalOp op, bool extend_selection) {
+	if (begin_record(op)) {
+		pending.push_back(extend_selection);
+	}
+}
+
+void Journal::record(JournalOp op, std::size_t column, std::size_t line) {
+	if (begin_record(op)) {
+		write_varint(pending, column);
+		write_varint(pending, line);
+	}
+}
+
+void Journal::record(JournalOp op, const char* text) {
+	if (begin_record(op)) {
+		const std::size_t length = strlen(text);
+		write_varint(pending, length);
+		pending.append(text, length);
+	}
+}
+
+void Journal::append_header(std::string& buffer) const {
+	buffer.append(JOURNAL_MAGIC);
+	write_varint(buffer, base_size);
+	write_varint(buffer, base_mtime);
+	write_varint(buffer, snapshot);
+}
+
+gboolean Journal::flush_callback(gpointer user_data) {
+	Journal* journal = (Journal*)user_data;
+	journal->flush_source_id = 0;
+	if (journal->editor && journal->journal_size + journal->pending.size() >= JOURNAL_COMPACTION_SIZE) {
+		journal->compact();
+	}
+	else {
+		journal->flush();
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// records the operations that place the cursors and their selections where they are in the editor, so that the operations after a snapshot apply to the same positions
+bool Journal::append_cursors(std::string& buffer) const {
+	std::map<std::size_t, RenderedLine> lines;
+	auto get_line = [&](std::size_t line) -> const RenderedLine& {
+		auto iter = lines.find(line);
+		if (iter == lines.end()) {
+			iter = lines.emplace(line, editor->render(line)).first;
+		}
+		return iter->second;
+	};
+	const std::size_t total_lines = editor->get_total_lines();
+	std::map<std::size_t, std::size_t> placed;
+	for (std::size_t i = 0; i < cursors->size(); ++i) {
+		const TrackedCursor& cursor = (*cursors)[i];
+		if (cursor.line >= total_lines || cursor.anchor >= total_lines) {
+			return false;
+		}
+		// cursors on the same line are matched to the rendered cursors in order
+		const RenderedLine& line = get_line(cursor.line);
+		const std::size_t index = placed[cursor.line]++;
+		if (index >= line.cursors.size()) {
+			return false;
+		}
+		const std::size_t column = line.cursors[index];
+		std::size_t anchor_column = column;
+		bool found = cursor.anchor == cursor.line;
+		const RenderedLine& anchor_line = get_line(cursor.anchor);
+		for (const Range& selection: anchor_line.selections) {
+			if (cursor.anchor < cursor.line && selection.end >= anchor_line.text.size()) {
+				anchor_column = selection.start;
+				found = true;
+			}
+			else if (cursor.anchor > cursor.line && selection.start == 0) {
+				anchor_column = std::min(selection.end, anchor_line.text.size());
+				found = true;
+			}
+			else if (cursor.anchor == cursor.line && selection.start != selection.end && (selection.start == column || selection.end == column)) {
+				anchor_column = selection.start == column ? selection.end : selection.start;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+		buffer.push_back((char)(i == 0 ? JournalOp::SET_CURSOR : JournalOp::TOGGLE_CURSOR));
+		write_varint(buffer, anchor_column);
+		write_varint(buffer, cursor.anchor);
+		if (anchor_column != column || cursor.anchor != cursor.line) {
+			buffer.push_back((char)JournalOp::EXTEND_SELECTION);
+			write_varint(buffer, column);
+			write_varint(buffer, cursor.line);
+		}
+	}
+	return true;
+}
+
+// saves the document to a new snapshot and starts the journal over from it; the old snapshot is only removed after the journal refers to the new one
+void Journal::compact() {
+	std::string cursor_ops;
+	if (!append_cursors(cursor_ops)) {
+		// the cursors could not be restored on top of a snapshot
+		flush();
+		return;
+	}
+	const guint64 new_snapshot = snapshot + 1;
+	const std::string snapshot_path = get_snapshot_path(new_snapshot);
+	editor->save(snapshot_path.c_str());
+	if (!g_file_test(snapshot_path.c_str(), G_FILE_TEST_IS_REGULAR)) {
+		g_warning("failed to write journal snapshot %s", snapshot_path.c_str());
+		flush();
+		return;
+	}
+	const guint64 old_snapshot = snapshot;
+	snapshot = new_snapshot;
+	pending.clear();
+	std::string header;
+	append_header(header);
+	header.append(cursor_ops);
+	journal_size = header.size();
+	g_thread_pool_push(writer, new Write(WriteKind::SYNC, snapshot_path), NULL);
+	g_thread_pool_push(writer, new Write(WriteKind::REPLACE, journal_path, std::move(header)), NULL);
+	if (old_snapshot > 0) {
+		g_thread_pool_push(writer, new Write(WriteKind::REMOVE, get_snapshot_path(old_snapshot)), NULL);
+	}
+	started = true;
+	replace = false;
+}
+
+// hands everything recorded since the last flush to the writer thread as a single write
+void Journal::flush() {
+	if (flush_source_id) {
+		g_source_remove(flush_source_id);
+		flush_source_id = 0;
+	}
+	if (pending.empty()) {
+		return;
+	}
+	journal_size = (replace ? 0 : journal_size) + pending.size();
+	g_thread_pool_push(writer, new Write(replace ? WriteKind::REPLACE : WriteKind::APPEND, journal_path, std::move(pending)), NULL);
+	pending.clear();
+	replace = false;
+}
+
+// called after the document has been saved; the saved file becomes the new base and the journal starts over
+void Journal::reset(const char* document_path) {
+	if (flush_source_id) {
+		g_source_remove(flush_source_id);
+		flush_source_id = 0;
+	}
+	pending.clear();
+	if (started) {
+		g_thread_pool_push(writer, new Write(WriteKind::REMOVE, journal_path), NULL);
+	}
+	if (snapshot > 0) {
+		g_thread_pool_push(writer, new Write(WriteKind::REMOVE, get_snapshot_path(snapshot)), NULL);
+	}
+	snapshot = 0;
+	journal_size = 0;
+	started = false;
+	replace = true;
+	set_document_path(document_path);
+}
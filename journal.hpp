@@ -0,0 +1,76 @@
+#pragma once
+
+#include "core/editor.hpp"
+#include <glib.h>
+#include <string>
+#include <vector>
+
+enum class JournalOp: unsigned char {
+	INSERT_TEXT,
+	INSERT_NEWLINE,
+	DELETE_BACKWARD,
+	DELETE_FORWARD,
+	MOVE_LEFT,
+	MOVE_RIGHT,
+	MOVE_UP,
+	MOVE_DOWN,
+	MOVE_TO_BEGINNING_OF_LINE,
+	MOVE_TO_END_OF_LINE,
+	SELECT_ALL,
+	CUT,
+	PASTE,
+	SET_CURSOR,
+	TOGGLE_CURSOR,
+	EXTEND_SELECTION
+};
+
+// the line of a cursor and the line where its selection started; the core only reports cursors as part of rendered lines, so the widget keeps track of the lines itself
+struct TrackedCursor {
+	std::size_t line;
+	std::size_t anchor;
+};
+
+// an append-only log of the operations applied to an editor since the document was last saved or since the last snapshot
+class Journal {
+	std::string journal_path;
+	// held with an exclusive lock while this journal records the document, so that a second editor of the same document doesn't write to it
+	int lock_fd;
+	// snapshots are named with the extension of the document, so that a recovered document is highlighted like the document itself
+	std::string extension;
+	guint64 base_size;
+	gint64 base_mtime;
+	guint64 snapshot;
+	std::size_t journal_size;
+	Editor* editor;
+	const std::vector<TrackedCursor>* cursors;
+	GThreadPool* writer;
+	std::string pending;
+	bool started;
+	bool replace;
+	guint flush_source_id;
+	void set_document_path(const char* document_path);
+	bool begin_record(JournalOp op);
+	void append_header(std::string& buffer) const;
+	std::string get_snapshot_path(guint64 snapshot) const;
+	bool append_cursors(std::string& buffer) const;
+	void compact();
+	static gboolean flush_callback(gpointer user_data);
+public:
+	Journal(const char* document_path);
+	Journal(const Journal&) = delete;
+	~Journal();
+	Journal& operator =(const Journal&) = delete;
+	// the document to open instead of the saved file if the journal has been compacted, or an empty string
+	std::string get_snapshot_path() const;
+	// replays the journal into the editor, which is also the editor that is snapshotted when the journal is compacted; the snapshot is followed by the given cursors
+	bool replay(Editor& editor, const std::vector<TrackedCursor>& cursors);
+	void record(JournalOp op);
+	void record(JournalOp op, bool extend_selection);
+	void record(JournalOp op, std::size_t column, std::size_t line);
+	void record(JournalOp op, const char* text);
+	void flush();
+	std::size_t get_pending_bytes() const {
+		return pending.capacity();
+	}
+	void reset(const char* document_path);
+};
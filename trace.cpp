@@ -0,0 +1,265 @@
+#include "trace.hpp"
+#include <glib/gstdio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define TRACE_HEADER "platon-trace 1"
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BAR_WIDTH 40
+
+static std::size_t get_bucket(guint64 duration) {
+	if (duration < SUB_BUCKETS) {
+		return duration;
+	}
+	const std::size_t exponent = g_bit_storage(duration) - 1;
+	const std::size_t sub_bucket = (duration >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+static guint64 get_bucket_start(std::size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	const std::size_t exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	return (guint64)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+}
+
+static guint64 get_bucket_width(std::size_t bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return 1;
+	}
+	const std::size_t exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	return (guint64)1 << (exponent - SUB_BUCKET_BITS);
+}
+
+Histogram::Histogram(): count(0), total(0), max(0) {
+	std::fill(std::begin(buckets), std::end(buckets), 0);
+}
+
+void Histogram::add(gint64 duration) {
+	duration = std::max<gint64>(duration, 0);
+	const std::size_t bucket = std::min(get_bucket(duration), G_N_ELEMENTS(buckets) - 1);
+	++buckets[bucket];
+	++count;
+	total += duration;
+	max = std::max(max, duration);
+}
+
+// returns the middle of the bucket containing the given percentile, so the error is at most 1/16 of the value
+gint64 Histogram::get_percentile(double percentile) const {
+	if (count == 0) {
+		return 0;
+	}
+	const std::size_t target = std::max<std::size_t>(std::ceil(percentile / 100.0 * count), 1);
+	std::size_t seen = 0;
+	for (std::size_t bucket = 0; bucket < G_N_ELEMENTS(buckets); ++bucket) {
+		seen += buckets[bucket];
+		if (seen >= target) {
+			return std::min<gint64>(get_bucket_start(bucket) + get_bucket_width(bucket) / 2, max);
+		}
+	}
+	return max;
+}
+
+void Histogram::append_report(std::string& report, const char* name) const {
+	gchar* line = g_strdup_printf("%s: %zu samples, mean %" G_GINT64_FORMAT " us, p50 %" G_GINT64_FORMAT " us, p95 %" G_GINT64_FORMAT " us, p99 %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us\n", name, count, count > 0 ? total / (gint64)count : 0, get_percentile(50.0), get_percentile(95.0), get_percentile(99.0), max);
+	report.append(line);
+	g_free(line);
+	// one row per power of two
+	std::size_t largest = 0;
+	std::size_t rows[G_N_ELEMENTS(buckets) / SUB_BUCKETS] = {};
+	for (std::size_t bucket = 0; bucket < G_N_ELEMENTS(buckets); ++bucket) {
+		rows[bucket / SUB_BUCKETS] += buckets[bucket];
+		largest = std::max(largest, rows[bucket / SUB_BUCKETS]);
+	}
+	for (std::size_t row = 0; row < G_N_ELEMENTS(rows); ++row) {
+		if (rows[row] == 0) {
+			continue;
+		}
+		const guint64 start = get_bucket_start(row * SUB_BUCKETS);
+		const guint64 end = get_bucket_start(row * SUB_BUCKETS + SUB_BUCKETS - 1) + get_bucket_width(row * SUB_BUCKETS + SUB_BUCKETS - 1);
+		const std::string bar(rows[row] * HISTOGRAM_BAR_WIDTH / largest, '#');
+		line = g_strdup_printf("  %10" G_GUINT64_FORMAT " - %10" G_GUINT64_FORMAT " us %8zu %s\n", start, end, rows[row], bar.c_str());
+		report.append(line);
+		g_free(line);
+	}
+}
+
+const char* TraceEvent::get_name() const {
+	switch (type) {
+	case COMMIT:
+		return "commit";
+	case PASTE:
+		return "paste";
+	case SIGNAL:
+		return text.c_str();
+	case PRESS:
+		return "press";
+	case DRAG:
+		return "drag";
+	case SCROLL:
+		return "scroll";
+	}
+	return "";
+}
+
+TraceWriter::TraceWriter(const char* path) {
+	file = g_fopen(path, "w");
+	if (!file) {
+		g_warning("failed to open trace %s", path);
+		return;
+	}
+	fputs(TRACE_HEADER "\n", file);
+	start_time = g_get_monotonic_time();
+}
+
+TraceWriter::~TraceWriter() {
+	if (file) {
+		fclose(file);
+	}
+}
+
+gint64 TraceWriter::get_time() const {
+	return g_get_monotonic_time() - start_time;
+}
+
+void TraceWriter::commit(const char* text) {
+	if (file) {
+		gchar* escaped = g_strescape(text, NULL);
+		fprintf(file, "%" G_GINT64_FORMAT " commit %s\n", get_time(), escaped);
+		fflush(file);
+		g_free(escaped);
+	}
+}
+
+void TraceWriter::paste(const char* text) {
+	if (file) {
+		gchar* escaped = g_strescape(text, NULL);
+		fprintf(file, "%" G_GINT64_FORMAT " paste %s\n", get_time(), escaped);
+		fflush(file);
+		g_free(escaped);
+	}
+}
+
+void TraceWriter::signal(const char* name) {
+	if (file) {
+		fprintf(file, "%" G_GINT64_FORMAT " signal %s\n", get_time(), name);
+		fflush(file);
+	}
+}
+
+void TraceWriter::signal(const char* name, bool argument) {
+	if (file) {
+		fprintf(file, "%" G_GINT64_FORMAT " signal %s %d\n", get_time(), name, argument);
+		fflush(file);
+	}
+}
+
+void TraceWriter::press(double x, double y, guint state) {
+	if (file) {
+		gchar x_string[G_ASCII_DTOSTR_BUF_SIZE];
+		gchar y_string[G_ASCII_DTOSTR_BUF_SIZE];
+		fprintf(file, "%" G_GINT64_FORMAT " press %s %s %u\n", get_time(), g_ascii_dtostr(x_string, sizeof(x_string), x), g_ascii_dtostr(y_string, sizeof(y_string), y), state);
+		fflush(file);
+	}
+}
+
+void TraceWriter::drag(double x, double y) {
+	if (file) {
+		gchar x_string[G_ASCII_DTOSTR_BUF_SIZE];
+		gchar y_string[G_ASCII_DTOSTR_BUF_SIZE];
+		fprintf(file, "%" G_GINT64_FORMAT " drag %s %s\n", get_time(), g_ascii_dtostr(x_string, sizeof(x_string), x), g_ascii_dtostr(y_string, sizeof(y_string), y));
+		fflush(file);
+	}
+}
+
+void TraceWriter::scroll(double value) {
+	if (file) {
+		gchar value_string[G_ASCII_DTOSTR_BUF_SIZE];
+		fprintf(file, "%" G_GINT64_FORMAT " scroll %s\n", get_time(), g_ascii_dtostr(value_string, sizeof(value_string), value));
+		fflush(file);
+	}
+}
+
+static bool parse_event(const gchar* line, TraceEvent& event) {
+	// the third field extends to the end of the line since the escaped text of commit and paste events can contain spaces
+	gchar** fields = g_strsplit(line, " ", 3);
+	if (g_strv_length(fields) < 2) {
+		g_strfreev(fields);
+		return false;
+	}
+	event.time = g_ascii_strtoll(fields[0], NULL, 10);
+	event.has_argument = false;
+	event.argument = false;
+	event.x = 0.0;
+	event.y = 0.0;
+	event.state = 0;
+	const gchar* rest = fields[2] ? fields[2] : "";
+	gchar** arguments = g_strsplit(rest, " ", -1);
+	const guint n_arguments = g_strv_length(arguments);
+	bool valid = true;
+	if (strcmp(fields[1], "commit") == 0 || strcmp(fields[1], "paste") == 0) {
+		event.type = strcmp(fields[1], "commit") == 0 ? TraceEvent::COMMIT : TraceEvent::PASTE;
+		gchar* text = g_strcompress(rest);
+		event.text = text;
+		g_free(text);
+	}
+	else if (strcmp(fields[1], "signal") == 0 && n_arguments >= 1) {
+		event.type = TraceEvent::SIGNAL;
+		event.text = arguments[0];
+		if (n_arguments >= 2) {
+			event.has_argument = true;
+			event.argument = g_ascii_strtoll(arguments[1], NULL, 10) != 0;
+		}
+	}
+	else if (strcmp(fields[1], "press") == 0 && n_arguments >= 3) {
+		event.type = TraceEvent::PRESS;
+		event.x = g_ascii_strtod(arguments[0], NULL);
+		event.y = g_ascii_strtod(arguments[1], NULL);
+		event.state = g_ascii_strtoull(arguments[2], NULL, 10);
+	}
+	else if (strcmp(fields[1], "drag") == 0 && n_arguments >= 2) {
+		event.type = TraceEvent::DRAG;
+		event.x = g_ascii_strtod(arguments[0], NULL);
+		event.y = g_ascii_strtod(arguments[1], NULL);
+	}
+	else if (strcmp(fields[1], "scroll") == 0 && n_arguments >= 1) {
+		event.type = TraceEvent::SCROLL;
+		event.y = g_ascii_strtod(arguments[0], NULL);
+	}
+	else {
+		valid = false;
+	}
+	g_strfreev(arguments);
+	g_strfreev(fields);
+	return valid;
+}
+
+bool read_trace(const char* path, std::vector<TraceEvent>& events) {
+	gchar* contents;
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		return false;
+	}
+	gchar** lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	if (!lines[0] || strcmp(lines[0], TRACE_HEADER) != 0) {
+		g_strfreev(lines);
+		return false;
+	}
+	for (gchar** line = lines + 1; *line; ++line) {
+		if (**line == '\0') {
+			continue;
+		}
+		TraceEvent event;
+		if (parse_event(*line, event)) {
+			events.push_back(std::move(event));
+		}
+		else {
+			g_warning("invalid trace event: %s", *line);
+		}
+	}
+	g_strfreev(lines);
+	return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glib.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// a histogram of durations in microseconds; every power of two is divided into eight buckets
+class Histogram {
+	std::size_t buckets[320];
+	std::size_t count;
+	gint64 total;
+	gint64 max;
+public:
+	Histogram();
+	void add(gint64 duration);
+	std::size_t get_count() const {
+		return count;
+	}
+	gint64 get_percentile(double percentile) const;
+	void append_report(std::string& report, const char* name) const;
+};
+
+struct TraceEvent {
+	enum Type {
+		COMMIT,
+		PASTE,
+		SIGNAL,
+		PRESS,
+		DRAG,
+		SCROLL
+	};
+	Type type;
+	gint64 time;
+	std::string text;
+	bool has_argument;
+	bool argument;
+	double x;
+	// the scroll position for scroll events
+	double y;
+	guint state;
+	const char* get_name() const;
+};
+
+// records the input of an editor widget, one event per line; every event is flushed so that a trace survives a crash of the editor being traced
+class TraceWriter {
+	FILE* file;
+	gint64 start_time;
+	gint64 get_time() const;
+public:
+	TraceWriter(const char* path);
+	TraceWriter(const TraceWriter&) = delete;
+	~TraceWriter();
+	TraceWriter& operator =(const TraceWriter&) = delete;
+	bool is_open() const {
+		return file != nullptr;
+	}
+	void commit(const char* text);
+	void paste(const char* text);
+	void signal(const char* name);
+	void signal(const char* name, bool argument);
+	void press(double x, double y, guint state);
+	void drag(double x, double y);
+	void scroll(double value);
+};
+
+bool read_trace(const char* path, std::vector<TraceEvent>& events);
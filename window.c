@@ -18,6 +18,21 @@ static void save(GSimpleAction* action, GVariant* parameter, gpointer user_data)
 	platon_editor_widget_save(editor_widget);
 }
 
+static void latency_report(GSimpleAction* action, GVariant* parameter, gpointer user_data) {
+	PlatonWindow* self = PLATON_WINDOW(user_data);
+	PlatonEditorWidget* editor_widget = get_editor_widget(self);
+	gchar* report = platon_editor_widget_get_latency_report(editor_widget);
+	g_message("%s", report);
+	g_free(report);
+}
+
+static void change_wrap_state(GSimpleAction* action, GVariant* value, gpointer user_data) {
+	PlatonWindow* self = PLATON_WINDOW(user_data);
+	PlatonEditorWidget* editor_widget = get_editor_widget(self);
+	g_object_set(editor_widget, "wrap", g_variant_get_boolean(value), NULL);
+	g_simple_action_set_state(action, value);
+}
+
 static void platon_window_class_init(PlatonWindowClass* klass) {
 
 }
@@ -30,6 +45,16 @@ static void platon_window_init(PlatonWindow* self) {
 	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(save_action));
 	g_object_unref(save_action);
 
+	GSimpleAction* wrap_action = g_simple_action_new_stateful("wrap", NULL, g_variant_new_boolean(FALSE));
+	g_signal_connect_object(wrap_action, "change-state", G_CALLBACK(change_wrap_state), self, 0);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(wrap_action));
+	g_object_unref(wrap_action);
+
+	GSimpleAction* latency_report_action = g_simple_action_new("latency-report", NULL);
+	g_signal_connect_object(latency_report_action, "activate", G_CALLBACK(latency_report), self, 0);
+	g_action_map_add_action(G_ACTION_MAP(self), G_ACTION(latency_report_action));
+	g_object_unref(latency_report_action);
+
 	GtkWidget* header_bar = gtk_header_bar_new();
 	gtk_header_bar_set_show_close_button(GTK_HEADER_BAR(header_bar), TRUE);
 	gtk_header_bar_set_title(GTK_HEADER_BAR(header_bar), "Platon");
@@ -45,9 +70,13 @@ PlatonWindow* platon_window_new(GtkApplication* application) {
 	return g_object_new(PLATON_TYPE_WINDOW, "application", application, NULL);
 }
 
-void platon_window_open_file(PlatonWindow* self, GFile* file) {
+PlatonEditorWidget* platon_window_get_editor_widget(PlatonWindow* self) {
+	return get_editor_widget(self);
+}
+
+void platon_window_open_file(PlatonWindow* self, GFile* file, gboolean journal) {
 	GtkWidget* scrolled_window = gtk_scrolled_window_new(NULL, NULL);
-	PlatonEditorWidget* editor_widget = platon_editor_widget_new(file);
+	PlatonEditorWidget* editor_widget = platon_editor_widget_new(file, journal);
 	gtk_container_add(GTK_CONTAINER(scrolled_window), GTK_WIDGET(editor_widget));
 	gtk_widget_show_all(scrolled_window);
 	gtk_container_add(GTK_CONTAINER(self), scrolled_window);
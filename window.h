@@ -1,6 +1,7 @@
 #pragma once
 
 #include <gtk/gtk.h>
+#include "editor_widget.h"
 
 G_BEGIN_DECLS
 
@@ -8,6 +9,7 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE(PlatonWindow, platon_window, PLATON, WINDOW, GtkApplicationWindow)
 
 PlatonWindow* platon_window_new(GtkApplication* application);
-void platon_window_open_file(PlatonWindow* window, GFile* file);
+void platon_window_open_file(PlatonWindow* window, GFile* file, gboolean journal);
+PlatonEditorWidget* platon_window_get_editor_widget(PlatonWindow* window);
 
 G_END_DECLS